@@ -0,0 +1,4 @@
+#include "arena.h"
+
+// Whether blocks are backed by huge pages
+bool arena_huge_pages;
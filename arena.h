@@ -0,0 +1,81 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+// Allocation of the large blocks of memory used by the trainer: the node and
+// hash tables, the string blocks and the memory pools. These are accessed at
+// random, so with 4K pages most accesses to a large model miss the TLB. Blocks
+// can instead be mapped on their own and backed by transparent huge pages,
+// which the kernel only does for memory advised with MADV_HUGEPAGE unless it
+// is configured to use them everywhere.
+
+// Size of a huge page. Only blocks of at least this size are backed by huge
+// pages, and they are rounded up to a multiple of it.
+#define ARENA_HUGE_PAGE_SIZE 0x200000
+
+// Whether blocks are backed by huge pages. Must be set before anything is
+// allocated, since blocks are freed according to how they were allocated.
+extern bool arena_huge_pages;
+
+// Get the size of the mapping of a block backed by huge pages
+static inline size_t arena_huge_size(size_t size)
+{
+	return (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+}
+
+// Map a block of memory backed by huge pages, which is zeroed
+static inline void *arena_map(size_t size)
+{
+	// Map an extra huge page so that the block can be aligned to one, and
+	// unmap what is left over on either side
+	size = arena_huge_size(size);
+	char *map = mmap(NULL, size + ARENA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(map != MAP_FAILED);
+	char *ptr = (char *)(((uintptr_t)map + ARENA_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE_SIZE - 1));
+	if (ptr != map)
+		munmap(map, ptr - map);
+	munmap(ptr + size, map + ARENA_HUGE_PAGE_SIZE - ptr);
+
+	// The advice is only a hint, so failing to follow it is not an error
+	madvise(ptr, size, MADV_HUGEPAGE);
+	return ptr;
+}
+
+// Allocate a block of memory
+static inline void *arena_alloc(size_t size)
+{
+	if (arena_huge_pages && size >= ARENA_HUGE_PAGE_SIZE)
+		return arena_map(size);
+
+	void *ptr = malloc(size);
+	assert(ptr);
+	return ptr;
+}
+
+// Allocate a zeroed block of memory
+static inline void *arena_calloc(size_t size)
+{
+	if (arena_huge_pages && size >= ARENA_HUGE_PAGE_SIZE)
+		return arena_map(size);
+
+	void *ptr = calloc(1, size);
+	assert(ptr);
+	return ptr;
+}
+
+// Free a block of memory of the given size obtained from arena_alloc() or
+// arena_calloc()
+static inline void arena_free(void *ptr, size_t size)
+{
+	if (!arena_huge_pages || size < ARENA_HUGE_PAGE_SIZE)
+		free(ptr);
+	else
+		munmap(ptr, arena_huge_size(size));
+}
+
+#endif
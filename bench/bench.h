@@ -0,0 +1,32 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "../math.h"
+
+// Helpers shared by the benchmarks. Every benchmark prints one line with the
+// time per operation, the throughput and the peak RSS of the process so far.
+
+// Get the peak resident set size of the process in kilobytes
+static inline long bench_peak_rss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+// Print the result of a benchmark. Bytes is the amount of data processed, or 0
+// if a byte rate makes no sense for the benchmark.
+static inline void bench_report(const char *name, int64_t ops, double elapsed, int64_t bytes)
+{
+	printf("%-28s %12lld ops %10.3fs %10.1f ns/op %12.0f ops/s", name, (long long)ops, elapsed,
+	       ops ? elapsed * 1e9 / ops : 0.0, elapsed > 0 ? ops / elapsed : 0.0);
+	if (bytes)
+		printf(" %8.1f MB/s", elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+	printf("  peak RSS %ldM\n", bench_peak_rss() / 1024);
+	fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,87 @@
+// Microbenchmarks of the generator. The generator is included whole, so that
+// its static functions can be timed directly.
+#define main generate_main
+#include "../generate.c"
+#undef main
+#include "bench.h"
+
+// Walk sentences through the model with the current sampler
+static inline void bench_walk(const char *name, int64_t num_sentences)
+{
+	struct rng_t rng;
+	rng_seed(&rng, markov_seed);
+	int64_t num_nodes = 0;
+	double start = get_time();
+	int64_t i;
+	for (i = 0; i < num_sentences; i++)
+		num_nodes += markov_walk(&rng);
+	bench_report(name, num_nodes, get_time() - start, 0);
+}
+
+// Generate the text of sentences, reusing the output buffer for each block
+static inline void bench_generate(const char *name, int64_t num_sentences)
+{
+	struct rng_t rng;
+	rng_seed(&rng, markov_seed);
+	struct markov_buffer_t buffer = {NULL, 0, 0};
+	int64_t bytes = 0;
+	double start = get_time();
+	int64_t i;
+	for (i = 0; i < num_sentences; i++) {
+		markov_generate_into(&rng, &buffer);
+		if (buffer.length >= 0x100000) {
+			bytes += buffer.length;
+			buffer.length = 0;
+		}
+	}
+	bytes += buffer.length;
+	bench_report(name, num_sentences, get_time() - start, bytes);
+	free(buffer.data);
+}
+
+int main(int argc, char **argv)
+{
+	markov_model_file = "bench.model";
+	markov_seed = 1;
+	int64_t num_sentences = 1000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:n:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			markov_model_file = optarg;
+			break;
+		case 'n':
+			num_sentences = atoll(optarg);
+			break;
+		case 's':
+			markov_seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			printf("Usage: %s [-m model] [-n sentences] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// Loading includes checking every section checksum
+	struct model_t error;
+	double start = get_time();
+	markov_current = markov_load(&error);
+	if (!markov_current) {
+		printf("%s\n", error.error);
+		return 1;
+	}
+	model_prefault(&markov_current->model);
+	bench_report("model load", 1, get_time() - start, markov_current->model.length);
+	markov_use_db(markov_current);
+	bool has_alias = markov_use_alias;
+
+	markov_use_alias = false;
+	bench_walk("walk (binary search)", num_sentences);
+	bench_generate("markov_generate (binary)", num_sentences);
+	if (has_alias) {
+		markov_use_alias = true;
+		bench_walk("walk (alias)", num_sentences);
+		bench_generate("markov_generate (alias)", num_sentences);
+	}
+	return 0;
+}
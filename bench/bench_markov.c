@@ -0,0 +1,230 @@
+// Microbenchmarks of the trainer. The trainer is included whole, so that its
+// static functions can be timed directly.
+#define main markov_main
+#include "../markov.c"
+#undef main
+#include <sys/stat.h>
+#include "bench.h"
+#include "zipf.h"
+
+// Keys of the nodes visited by each sentence of the corpus, in the order that
+// markov_train() visits them, and the index of the first key of each sentence
+static string_id_t (*bench_keys)[MARKOV_ORDER];
+static int64_t bench_num_keys;
+static int64_t *bench_sentences;
+static int64_t bench_num_sentences;
+
+// Nodes found for each key
+static struct markov_node_t **bench_nodes;
+
+// Compare two counts for sorting in decreasing order
+static int bench_compare_counts(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x < y) - (x > y);
+}
+
+// Print how the lookups of a corpus spread over the shards of the string
+// table. Every lookup takes the lock of its shard, so a few busy shards
+// serialize training threads.
+static inline void bench_string_shards(char (*words)[16], const int *ranks, int64_t num_ranks)
+{
+	int64_t lookups[TABLE_SHARDS];
+	memset(lookups, 0, sizeof(lookups));
+	int64_t total = 0;
+	int64_t j;
+	for (j = 0; j < num_ranks; j++) {
+		if (ranks[j] < 0)
+			continue;
+		lookups[table_shard(&string_table, string_hash(words[ranks[j]])) - string_table.shards]++;
+		total++;
+	}
+
+	// Count the busiest shards which take half of the lookups
+	qsort(lookups, TABLE_SHARDS, sizeof(int64_t), bench_compare_counts);
+	int64_t sum = 0;
+	int half;
+	for (half = 0; sum * 2 < total; half++)
+		sum += lookups[half];
+	printf("string_copy shards: busiest takes %.1f%% of lookups, %d of %d take half\n",
+	       total ? 100.0 * lookups[0] / total : 0.0, half, TABLE_SHARDS);
+}
+
+// Intern every word of the corpus, and collect the keys of its nodes
+static inline void bench_string_copy(struct zipf_t *zipf, const char *name)
+{
+	char (*words)[16] = malloc(sizeof(*words) * zipf->options.vocabulary);
+	assert(words);
+	int i;
+	for (i = 0; i < zipf->options.vocabulary; i++)
+		zipf_word(i, words[i]);
+
+	// Draw the corpus up front so that only string_copy() is timed
+	int64_t size = zipf->options.tokens + zipf->options.tokens / zipf->options.mean_length * 2 + 16;
+	int *ranks = malloc(sizeof(int) * size);
+	assert(ranks);
+	int64_t num_ranks = 0;
+	int64_t bytes = 0;
+	int rank;
+	while ((rank = zipf_next(zipf)) != -2) {
+		if (num_ranks == size) {
+			size *= 2;
+			ranks = realloc(ranks, sizeof(int) * size);
+			assert(ranks);
+		}
+		ranks[num_ranks++] = rank;
+		if (rank >= 0)
+			bytes += strlen(words[rank]);
+	}
+
+	string_id_t *ids = malloc(sizeof(string_id_t) * num_ranks);
+	assert(ids);
+	int64_t j;
+	double start = get_time();
+	for (j = 0; j < num_ranks; j++)
+		ids[j] = ranks[j] >= 0 ? string_copy(words[ranks[j]]) : 0;
+	bench_report(name, zipf->options.tokens, get_time() - start, bytes);
+
+	// Every word is known the second time around
+	start = get_time();
+	for (j = 0; j < num_ranks; j++) {
+		if (ranks[j] >= 0)
+			ids[j] = string_copy(words[ranks[j]]);
+	}
+	bench_report("string_copy (existing)", zipf->options.tokens, get_time() - start, bytes);
+	bench_string_shards(words, ranks, num_ranks);
+
+	// Build the node keys of each sentence like markov_train(), including
+	// the last node which ends the sentence
+	bench_keys = malloc(sizeof(*bench_keys) * (num_ranks + 1));
+	bench_sentences = malloc(sizeof(int64_t) * (num_ranks + 1));
+	assert(bench_keys && bench_sentences);
+	int64_t first = 0;
+	for (j = 0; j < num_ranks; j++) {
+		if (ids[j])
+			continue;
+
+		// Empty sentences are ignored like in markov_train()
+		int length = j - first;
+		if (!length) {
+			first = j + 1;
+			continue;
+		}
+
+		bench_sentences[bench_num_sentences++] = bench_num_keys;
+		int64_t k;
+		for (k = first; k + MARKOV_ORDER <= j + 1; k++) {
+			int m;
+			for (m = 0; m < MARKOV_ORDER; m++)
+				bench_keys[bench_num_keys][m] = k + m < j ? ids[k + m] : 0;
+			bench_num_keys++;
+			if (length < MARKOV_ORDER)
+				break;
+		}
+		first = j + 1;
+	}
+	bench_sentences[bench_num_sentences] = bench_num_keys;
+
+	free(words);
+	free(ranks);
+	free(ids);
+}
+
+// Look up the node of every key
+static inline void bench_get_node(const char *name)
+{
+	double start = get_time();
+	int64_t i;
+	for (i = 0; i < bench_num_keys; i++)
+		bench_nodes[i] = markov_get_node(bench_keys[i]);
+	bench_report(name, bench_num_keys, get_time() - start, 0);
+}
+
+// Add the exits between the nodes of every sentence, and its start state
+static inline void bench_add_exit(void)
+{
+	double start = get_time();
+	int64_t num_exits = 0;
+	int64_t i;
+	for (i = 0; i < bench_num_sentences; i++) {
+		int64_t k;
+		for (k = bench_sentences[i]; k + 1 < bench_sentences[i + 1]; k++)
+			markov_add_exit(bench_nodes[k], bench_nodes[k + 1], 1);
+		num_exits += bench_sentences[i + 1] - bench_sentences[i] - 1;
+	}
+	bench_report("markov_add_exit", num_exits, get_time() - start, 0);
+
+	start = get_time();
+	for (i = 0; i < bench_num_sentences; i++)
+		markov_add_start(bench_nodes[bench_sentences[i]], 1);
+	bench_report("markov_add_start", bench_num_sentences, get_time() - start, 0);
+}
+
+// Export the model
+static inline void bench_export(const char *file)
+{
+	int64_t num_nodes = 0;
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++)
+		num_nodes += markov_table[i].count;
+
+	double start = get_time();
+	markov_export(file);
+	double elapsed = get_time() - start;
+
+	struct stat buf;
+	stat(file, &buf);
+	bench_report("markov_export", num_nodes, elapsed, buf.st_size);
+}
+
+int main(int argc, char **argv)
+{
+	struct zipf_options_t options;
+	zipf_defaults(&options);
+	const char *model_file = "bench.model";
+	int opt;
+	while ((opt = getopt(argc, argv, ZIPF_OPTIONS "aHj:o:")) != -1) {
+		if (zipf_parse_option(&options, opt, optarg))
+			continue;
+		switch (opt) {
+		case 'a':
+			markov_export_alias = true;
+			break;
+		case 'H':
+			arena_huge_pages = true;
+			break;
+		case 'j':
+			markov_num_threads = atoi(optarg);
+			if (markov_num_threads < 1 || markov_num_threads > MARKOV_MAX_THREADS) {
+				printf("Number of threads must be between 1 and %d\n", MARKOV_MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 'o':
+			model_file = optarg;
+			break;
+		default:
+			printf("Usage: %s " ZIPF_USAGE " [-a] [-H] [-j export threads] [-o model]\n", argv[0]);
+			return 1;
+		}
+	}
+	zipf_check_options(&options);
+
+	markov_init();
+	struct zipf_t zipf;
+	zipf_init(&zipf, &options);
+	printf("Corpus: %lld tokens, vocabulary %d, exponent %g, mean sentence length %g, seed %llu\n",
+	       (long long)options.tokens, options.vocabulary, options.exponent, options.mean_length,
+	       (unsigned long long)options.seed);
+
+	bench_string_copy(&zipf, "string_copy (new)");
+	zipf_free(&zipf);
+
+	bench_nodes = malloc(sizeof(struct markov_node_t *) * bench_num_keys);
+	assert(bench_nodes);
+	bench_get_node("markov_get_node (new)");
+	bench_get_node("markov_get_node (existing)");
+	bench_add_exit();
+	bench_export(model_file);
+	return 0;
+}
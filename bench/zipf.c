@@ -0,0 +1,38 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "zipf.h"
+
+// Write a synthetic Zipf-distributed corpus to the standard output, in the
+// input format of the trainer: one word per line, with an empty line after
+// each sentence.
+int main(int argc, char **argv)
+{
+	struct zipf_options_t options;
+	zipf_defaults(&options);
+	int opt;
+	while ((opt = getopt(argc, argv, ZIPF_OPTIONS)) != -1) {
+		if (!zipf_parse_option(&options, opt, optarg)) {
+			printf("Usage: %s " ZIPF_USAGE "\n", argv[0]);
+			return 1;
+		}
+	}
+	zipf_check_options(&options);
+
+	static char buffer[0x100000];
+	setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+	struct zipf_t zipf;
+	zipf_init(&zipf, &options);
+	char word[16];
+	int rank;
+	while ((rank = zipf_next(&zipf)) != -2) {
+		if (rank == -1) {
+			putchar('\n');
+			continue;
+		}
+		zipf_word(rank, word);
+		puts(word);
+	}
+	zipf_free(&zipf);
+	return 0;
+}
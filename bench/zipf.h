@@ -0,0 +1,180 @@
+#ifndef ZIPF_H_
+#define ZIPF_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <math.h>
+#include "../math.h"
+#include "../rng.h"
+
+// Reproducible synthetic corpus. Words are drawn from a Zipf distribution over
+// the vocabulary, so the word of rank k has a probability proportional to
+// 1/k^exponent, and sentence lengths follow a geometric distribution with the
+// given mean, capped at the maximum. The same settings and seed always give the
+// same corpus.
+
+// Settings of a corpus
+struct zipf_options_t {
+	int vocabulary;
+	double exponent;
+	int64_t tokens;
+	double mean_length;
+	int max_length;
+	uint64_t seed;
+};
+
+// State of a corpus generator
+struct zipf_t {
+	struct zipf_options_t options;
+	double *cdf;
+	struct rng_t rng;
+	int64_t tokens;
+	int length;
+};
+
+// Default settings, roughly matching an English text corpus
+static inline void zipf_defaults(struct zipf_options_t *options)
+{
+	options->vocabulary = 100000;
+	options->exponent = 1.0;
+	options->tokens = 10000000;
+	options->mean_length = 15;
+	options->max_length = 100;
+	options->seed = 1;
+}
+
+// Parse a corpus option from the command line. Returns false if the option is
+// not a corpus option.
+static inline bool zipf_parse_option(struct zipf_options_t *options, int opt, const char *arg)
+{
+	switch (opt) {
+	case 'v':
+		options->vocabulary = atoi(arg);
+		break;
+	case 'e':
+		options->exponent = atof(arg);
+		break;
+	case 't':
+		options->tokens = atoll(arg);
+		break;
+	case 'l':
+		options->mean_length = atof(arg);
+		break;
+	case 'L':
+		options->max_length = atoi(arg);
+		break;
+	case 's':
+		options->seed = strtoull(arg, NULL, 0);
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+// Command line options understood by zipf_parse_option(), for getopt() and for
+// usage messages
+#define ZIPF_OPTIONS "v:e:t:l:L:s:"
+#define ZIPF_USAGE "[-v vocabulary] [-e exponent] [-t tokens] [-l mean length] [-L max length] [-s seed]"
+
+// Check that corpus settings make sense, and exit with a message if not
+static inline void zipf_check_options(const struct zipf_options_t *options)
+{
+	if (options->vocabulary < 1 || options->tokens < 0 || options->mean_length < 1 || options->max_length < 1) {
+		printf("Vocabulary, mean and max sentence length must be at least 1\n");
+		exit(1);
+	}
+}
+
+// Start generating a corpus
+static inline void zipf_init(struct zipf_t *zipf, const struct zipf_options_t *options)
+{
+	zipf->options = *options;
+	zipf->cdf = malloc(sizeof(double) * options->vocabulary);
+	assert(zipf->cdf);
+	double total = 0;
+	int i;
+	for (i = 0; i < options->vocabulary; i++) {
+		total += pow(i + 1, -options->exponent);
+		zipf->cdf[i] = total;
+	}
+	for (i = 0; i < options->vocabulary; i++)
+		zipf->cdf[i] /= total;
+	rng_seed(&zipf->rng, options->seed);
+	zipf->tokens = 0;
+	zipf->length = 0;
+}
+
+// Release a corpus generator
+static inline void zipf_free(struct zipf_t *zipf)
+{
+	free(zipf->cdf);
+}
+
+// Get a uniform random number in [0, 1)
+static inline double zipf_uniform(struct zipf_t *zipf)
+{
+	return (rng_next(&zipf->rng) >> 11) * 0x1.0p-53;
+}
+
+// Pick the rank of a random word, starting from 0 for the most common one
+static inline int zipf_rank(struct zipf_t *zipf)
+{
+	double x = zipf_uniform(zipf);
+	int low = 0;
+	int high = zipf->options.vocabulary - 1;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (zipf->cdf[middle] <= x)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// Get the word for a rank. Words are letters counting up in bijective base 26
+// ("a", ..., "z", "aa", ...), so that common words are short.
+static inline void zipf_word(int rank, char *word)
+{
+	char buffer[16];
+	int length = 0;
+	rank++;
+	while (rank) {
+		rank--;
+		buffer[length++] = 'a' + rank % 26;
+		rank /= 26;
+	}
+	int i;
+	for (i = 0; i < length; i++)
+		word[i] = buffer[length - 1 - i];
+	word[length] = '\0';
+}
+
+// Get the next token of the corpus. Returns the rank of the word, -1 at the end
+// of a sentence, or -2 once all tokens have been generated.
+static inline int zipf_next(struct zipf_t *zipf)
+{
+	if (!zipf->length) {
+		if (zipf->tokens == zipf->options.tokens)
+			return -2;
+
+		// Pick the length of the next sentence
+		int length = 1;
+		double p = 1 / zipf->options.mean_length;
+		while (length < zipf->options.max_length && zipf_uniform(zipf) >= p)
+			length++;
+		zipf->length = min(length, zipf->options.tokens - zipf->tokens) + 1;
+	}
+
+	if (--zipf->length == 0)
+		return -1;
+	zipf->tokens++;
+	return zipf_rank(zipf);
+}
+
+#endif
@@ -2,34 +2,63 @@
  * cbeardy.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include "scan.h"
+
+// Number of bytes read at once. Each byte of input becomes at most two bytes
+// of output.
+#define READ_SIZE 0x100000
 
 int main(void)
 {
 	bool readDot = false;
 	bool readSpace = false;
 
-	int c;
-	while ((c = getchar()) != EOF) {
-		switch (c) {
-			case ' ':
-				if (!readSpace)
-					putchar('\n');
-				readSpace = true;
-				break;
-			case '.':
-				if (!readDot) {
-					putchar('\n');
-					putchar('\n');
-				}
-				readDot = true;
-				break;
-			default:
+	char *in = malloc(READ_SIZE);
+	char *out = malloc(READ_SIZE * 2);
+	if (!in || !out) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	size_t length;
+	while ((length = fread(in, 1, READ_SIZE, stdin))) {
+		const char *p = in;
+		const char *end = in + length;
+		char *o = out;
+		while (p < end) {
+			// Copy everything up to the next space or dot as it is
+			const char *next = scan_find2(p, end, ' ', '.');
+			if (next != p) {
+				memcpy(o, p, next - p);
+				o += next - p;
 				readSpace = readDot = false;
-				putchar(c);
-				break;
+				p = next;
+				if (p == end)
+					break;
+			}
+
+			switch (*p++) {
+				case ' ':
+					if (!readSpace)
+						*o++ = '\n';
+					readSpace = true;
+					break;
+				case '.':
+					if (!readDot) {
+						*o++ = '\n';
+						*o++ = '\n';
+					}
+					readDot = true;
+					break;
+			}
 		}
+		fwrite(out, 1, o - out, stdout);
 	}
 
+	free(in);
+	free(out);
 	return 0;
 }
@@ -0,0 +1,471 @@
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <bzlib.h>
+
+// Reading of dumps which may be compressed. gzip and bzip2 input is recognised
+// by its magic number and decompressed on background threads, so that
+// decompression overlaps with parsing. Decompressed data is handed over in
+// slots, which are consumed in order.
+//
+// A bzip2 file made of many streams, like the multistream dumps of Wikipedia,
+// is split between streams, which start on a byte boundary with a magic
+// number. Runs of whole streams are then decompressed in parallel. Any other
+// compressed file is decompressed as it is read by a single thread.
+
+// Number of compressed bytes read at once, and the least number of compressed
+// bytes of a run of bzip2 streams decompressed by a thread
+#define DUMP_READ_SIZE 0x100000
+
+// Number of decompressed bytes in each slot when decompressing as a whole
+#define DUMP_BLOCK_SIZE 0x100000
+
+// Number of bytes at the start of a bzip2 file in which a second stream is
+// looked for, to tell whether it can be decompressed in parallel
+#define DUMP_PROBE_SIZE 0x1000000
+
+// Maximum number of decompression threads, and the number of slots per thread
+#define DUMP_MAX_THREADS 64
+#define DUMP_SLOTS_PER_THREAD 2
+
+// Formats of dumps
+enum {
+	DUMP_PLAIN,
+	DUMP_GZIP,
+	DUMP_BZIP2,
+};
+
+// Decompressed data in order, and for a run of bzip2 streams the compressed
+// data it is decompressed from
+struct dump_slot_t {
+	char *data;
+	size_t length;
+	size_t size;
+	char *input;
+	size_t input_length;
+	size_t input_size;
+	bool ready;
+};
+
+// A dump being read. The compressed input is buffered from input_start to
+// input_length. Slots are filled from next_slot on, and read from next_read
+// on, which stops at end_slot once the input is exhausted.
+struct dump_t {
+	FILE *file;
+	int format;
+	bool multistream;
+
+	char *input;
+	size_t input_start;
+	size_t input_length;
+	size_t input_size;
+	bool input_eof;
+
+	struct dump_slot_t *slots;
+	int num_slots;
+	int64_t next_slot;
+	int64_t next_read;
+	int64_t end_slot;
+	size_t position;
+	bool closing;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	pthread_t threads[DUMP_MAX_THREADS];
+	int num_threads;
+};
+
+// Grow a buffer so that it can hold at least the given number of bytes
+static inline char *dump_grow(char *buffer, size_t *size, size_t needed)
+{
+	if (needed <= *size)
+		return buffer;
+	while (*size < needed)
+		*size = *size ? *size * 2 : DUMP_READ_SIZE;
+	buffer = realloc(buffer, *size);
+	if (!buffer) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return buffer;
+}
+
+// Read more compressed input into the buffer. Returns false at the end of
+// the file.
+static inline bool dump_read_input(struct dump_t *dump)
+{
+	if (dump->input_eof)
+		return false;
+
+	// Move the unused input to the front of the buffer
+	if (dump->input_start) {
+		memmove(dump->input, dump->input + dump->input_start, dump->input_length - dump->input_start);
+		dump->input_length -= dump->input_start;
+		dump->input_start = 0;
+	}
+
+	dump->input = dump_grow(dump->input, &dump->input_size, dump->input_length + DUMP_READ_SIZE);
+	size_t length = fread(dump->input + dump->input_length, 1, dump->input_size - dump->input_length, dump->file);
+	if (ferror(dump->file)) {
+		fprintf(stderr, "Error reading dump: %s\n", strerror(errno));
+		exit(1);
+	}
+	dump->input_length += length;
+	dump->input_eof = length == 0;
+	return length != 0;
+}
+
+// Check whether a bzip2 stream starts at a position
+static inline bool dump_bzip2_magic(const char *data)
+{
+	return !memcmp(data, "BZh", 3) && data[3] >= '1' && data[3] <= '9' && !memcmp(data + 4, "\x31\x41\x59\x26\x53\x59", 6);
+}
+
+// Find the start of a bzip2 stream in the buffered input, from an offset on.
+// Returns 0 if there is none.
+static inline size_t dump_find_stream(struct dump_t *dump, size_t offset)
+{
+	const char *data = dump->input;
+	while (offset + 10 <= dump->input_length) {
+		const char *p = memchr(data + offset, 'B', dump->input_length - 9 - offset);
+		if (!p)
+			return 0;
+		if (dump_bzip2_magic(p))
+			return p - data;
+		offset = p - data + 1;
+	}
+	return 0;
+}
+
+// Move the next run of whole bzip2 streams of at least DUMP_READ_SIZE bytes
+// from the input to a slot. Returns false once the input is exhausted. Must be
+// called with the lock held.
+static inline bool dump_split_streams(struct dump_t *dump, struct dump_slot_t *slot)
+{
+	if (dump->input_start == dump->input_length && !dump_read_input(dump))
+		return false;
+
+	// Look for a stream starting far enough ahead
+	size_t offset = DUMP_READ_SIZE;
+	size_t end;
+	for (;;) {
+		end = dump_find_stream(dump, dump->input_start + offset);
+		if (end)
+			break;
+		if (dump->input_length - dump->input_start > offset + 9)
+			offset = dump->input_length - dump->input_start - 9;
+		if (!dump_read_input(dump)) {
+			end = dump->input_length;
+			break;
+		}
+	}
+
+	slot->input_length = end - dump->input_start;
+	slot->input = dump_grow(slot->input, &slot->input_size, slot->input_length);
+	memcpy(slot->input, dump->input + dump->input_start, slot->input_length);
+	dump->input_start = end;
+	return true;
+}
+
+// Append the decompressed data of a run of whole bzip2 streams to a slot
+static inline void dump_decompress_streams(struct dump_slot_t *slot)
+{
+	bz_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.next_in = slot->input;
+	stream.avail_in = slot->input_length;
+	slot->length = 0;
+	while (stream.avail_in) {
+		if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+			fprintf(stderr, "Error initializing bzip2\n");
+			exit(1);
+		}
+		int result;
+		do {
+			slot->data = dump_grow(slot->data, &slot->size, slot->length + DUMP_BLOCK_SIZE);
+			stream.next_out = slot->data + slot->length;
+			stream.avail_out = slot->size - slot->length;
+			result = BZ2_bzDecompress(&stream);
+			slot->length = stream.next_out - slot->data;
+			if (result != BZ_OK && result != BZ_STREAM_END) {
+				fprintf(stderr, "Error decompressing bzip2 stream: %d\n", result);
+				exit(1);
+			}
+			if (result == BZ_OK && !stream.avail_in && stream.avail_out) {
+				fprintf(stderr, "Truncated bzip2 stream\n");
+				exit(1);
+			}
+		} while (result != BZ_STREAM_END);
+		BZ2_bzDecompressEnd(&stream);
+	}
+}
+
+// Decompression thread for a multistream bzip2 file. Takes runs of streams
+// off the input in order and decompresses them into their slots.
+static void *dump_streams_worker(void *arg)
+{
+	struct dump_t *dump = arg;
+	pthread_mutex_lock(&dump->lock);
+	for (;;) {
+		while (dump->next_slot - dump->next_read >= dump->num_slots && !dump->closing)
+			pthread_cond_wait(&dump->cond, &dump->lock);
+		if (dump->closing || dump->end_slot >= 0)
+			break;
+
+		int64_t index = dump->next_slot;
+		struct dump_slot_t *slot = &dump->slots[index % dump->num_slots];
+		if (!dump_split_streams(dump, slot)) {
+			dump->end_slot = index;
+			pthread_cond_broadcast(&dump->cond);
+			break;
+		}
+		dump->next_slot++;
+		pthread_mutex_unlock(&dump->lock);
+
+		dump_decompress_streams(slot);
+
+		pthread_mutex_lock(&dump->lock);
+		slot->ready = true;
+		pthread_cond_broadcast(&dump->cond);
+	}
+	pthread_mutex_unlock(&dump->lock);
+	return NULL;
+}
+
+// Decompress a gzip file or a bzip2 file with a single stream into the next
+// slot, continuing where the last call left off. Returns false once the end
+// of the compressed data has been reached.
+static inline bool dump_decompress(struct dump_t *dump, struct dump_slot_t *slot, z_stream *gzip, bz_stream *bzip2)
+{
+	slot->data = dump_grow(slot->data, &slot->size, DUMP_BLOCK_SIZE);
+	slot->length = 0;
+	while (slot->length < DUMP_BLOCK_SIZE) {
+		if (dump->input_start == dump->input_length && !dump_read_input(dump)) {
+			fprintf(stderr, "Truncated %s stream\n", dump->format == DUMP_GZIP ? "gzip" : "bzip2");
+			exit(1);
+		}
+
+		size_t available = dump->input_length - dump->input_start;
+		size_t space = DUMP_BLOCK_SIZE - slot->length;
+		size_t used;
+		bool stream_end;
+		if (dump->format == DUMP_GZIP) {
+			gzip->next_in = (Bytef *)dump->input + dump->input_start;
+			gzip->avail_in = available;
+			gzip->next_out = (Bytef *)slot->data + slot->length;
+			gzip->avail_out = space;
+			int result = inflate(gzip, Z_NO_FLUSH);
+			if (result != Z_OK && result != Z_STREAM_END) {
+				fprintf(stderr, "Error decompressing gzip stream: %s\n", gzip->msg ? gzip->msg : "unknown error");
+				exit(1);
+			}
+			used = available - gzip->avail_in;
+			slot->length += space - gzip->avail_out;
+			stream_end = result == Z_STREAM_END;
+		} else {
+			bzip2->next_in = dump->input + dump->input_start;
+			bzip2->avail_in = available;
+			bzip2->next_out = slot->data + slot->length;
+			bzip2->avail_out = space;
+			int result = BZ2_bzDecompress(bzip2);
+			if (result != BZ_OK && result != BZ_STREAM_END) {
+				fprintf(stderr, "Error decompressing bzip2 stream: %d\n", result);
+				exit(1);
+			}
+			used = available - bzip2->avail_in;
+			slot->length += space - bzip2->avail_out;
+			stream_end = result == BZ_STREAM_END;
+		}
+		dump->input_start += used;
+
+		// Files may hold several streams one after the other
+		if (stream_end) {
+			if (dump->input_start == dump->input_length && !dump_read_input(dump))
+				return false;
+			if (dump->format == DUMP_GZIP)
+				inflateReset(gzip);
+			else {
+				BZ2_bzDecompressEnd(bzip2);
+				BZ2_bzDecompressInit(bzip2, 0, 0);
+			}
+		}
+	}
+	return true;
+}
+
+// Decompression thread for any other compressed file, which fills the slots
+// one after the other
+static void *dump_stream_worker(void *arg)
+{
+	struct dump_t *dump = arg;
+	z_stream gzip;
+	bz_stream bzip2;
+	memset(&gzip, 0, sizeof(gzip));
+	memset(&bzip2, 0, sizeof(bzip2));
+	if (dump->format == DUMP_GZIP ? inflateInit2(&gzip, 15 + 32) != Z_OK : BZ2_bzDecompressInit(&bzip2, 0, 0) != BZ_OK) {
+		fprintf(stderr, "Error initializing decompression\n");
+		exit(1);
+	}
+
+	bool more = true;
+	while (more) {
+		pthread_mutex_lock(&dump->lock);
+		while (dump->next_slot - dump->next_read >= dump->num_slots && !dump->closing)
+			pthread_cond_wait(&dump->cond, &dump->lock);
+		struct dump_slot_t *slot = &dump->slots[dump->next_slot % dump->num_slots];
+		bool closing = dump->closing;
+		pthread_mutex_unlock(&dump->lock);
+		if (closing)
+			break;
+
+		more = dump_decompress(dump, slot, &gzip, &bzip2);
+
+		pthread_mutex_lock(&dump->lock);
+		slot->ready = true;
+		dump->next_slot++;
+		if (!more)
+			dump->end_slot = dump->next_slot;
+		pthread_cond_broadcast(&dump->cond);
+		pthread_mutex_unlock(&dump->lock);
+	}
+
+	if (dump->format == DUMP_GZIP)
+		inflateEnd(&gzip);
+	else
+		BZ2_bzDecompressEnd(&bzip2);
+	return NULL;
+}
+
+// Start reading a dump from a file, decompressing it if needed with up to the
+// given number of threads
+static inline void dump_open(struct dump_t *dump, FILE *file, int num_threads)
+{
+	memset(dump, 0, sizeof(struct dump_t));
+	dump->file = file;
+	dump->end_slot = -1;
+	pthread_mutex_init(&dump->lock, NULL);
+	pthread_cond_init(&dump->cond, NULL);
+
+	// Recognise the format from the start of the file
+	dump_read_input(dump);
+	const char *data = dump->input;
+	if (dump->input_length >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b)
+		dump->format = DUMP_GZIP;
+	else if (dump->input_length >= 10 && dump_bzip2_magic(data))
+		dump->format = DUMP_BZIP2;
+	else
+		return;
+
+	// Look for a second bzip2 stream near the start
+	if (dump->format == DUMP_BZIP2) {
+		size_t offset = 1;
+		while (!(dump->multistream = dump_find_stream(dump, offset) != 0) && dump->input_length < DUMP_PROBE_SIZE) {
+			if (dump->input_length > 10)
+				offset = dump->input_length - 9;
+			if (!dump_read_input(dump))
+				break;
+		}
+	}
+	if (num_threads < 1 || !dump->multistream)
+		num_threads = 1;
+	if (num_threads > DUMP_MAX_THREADS)
+		num_threads = DUMP_MAX_THREADS;
+
+	dump->num_slots = num_threads * DUMP_SLOTS_PER_THREAD;
+	dump->slots = calloc(dump->num_slots, sizeof(struct dump_slot_t));
+	if (!dump->slots) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	dump->num_threads = num_threads;
+	int i;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&dump->threads[i], NULL, dump->multistream ? dump_streams_worker : dump_stream_worker, dump)) {
+			fprintf(stderr, "Error creating decompression thread\n");
+			exit(1);
+		}
+	}
+}
+
+// Read up to the given number of bytes of the dump. Fewer bytes are only
+// returned at the end of the dump.
+static inline size_t dump_read(struct dump_t *dump, char *buffer, size_t length)
+{
+	size_t total = 0;
+
+	// Uncompressed input is read directly, after what was read to recognise it
+	if (dump->format == DUMP_PLAIN) {
+		size_t buffered = dump->input_length - dump->input_start;
+		if (buffered > length)
+			buffered = length;
+		memcpy(buffer, dump->input + dump->input_start, buffered);
+		dump->input_start += buffered;
+		total = buffered;
+		if (total < length)
+			total += fread(buffer + total, 1, length - total, dump->file);
+		if (ferror(dump->file)) {
+			fprintf(stderr, "Error reading dump: %s\n", strerror(errno));
+			exit(1);
+		}
+		return total;
+	}
+
+	while (total < length) {
+		struct dump_slot_t *slot = &dump->slots[dump->next_read % dump->num_slots];
+		pthread_mutex_lock(&dump->lock);
+		while (!slot->ready && dump->next_read != dump->end_slot)
+			pthread_cond_wait(&dump->cond, &dump->lock);
+		pthread_mutex_unlock(&dump->lock);
+		if (!slot->ready)
+			break;
+
+		size_t available = slot->length - dump->position;
+		if (available > length - total)
+			available = length - total;
+		memcpy(buffer + total, slot->data + dump->position, available);
+		dump->position += available;
+		total += available;
+
+		// Hand the slot back once it has been read
+		if (dump->position == slot->length) {
+			pthread_mutex_lock(&dump->lock);
+			slot->ready = false;
+			dump->next_read++;
+			dump->position = 0;
+			pthread_cond_broadcast(&dump->cond);
+			pthread_mutex_unlock(&dump->lock);
+		}
+	}
+	return total;
+}
+
+// Stop reading a dump, and free its buffers
+static inline void dump_close(struct dump_t *dump)
+{
+	pthread_mutex_lock(&dump->lock);
+	dump->closing = true;
+	pthread_cond_broadcast(&dump->cond);
+	pthread_mutex_unlock(&dump->lock);
+
+	int i;
+	for (i = 0; i < dump->num_threads; i++)
+		pthread_join(dump->threads[i], NULL);
+	for (i = 0; i < dump->num_slots; i++) {
+		free(dump->slots[i].data);
+		free(dump->slots[i].input);
+	}
+	free(dump->slots);
+	free(dump->input);
+	pthread_mutex_destroy(&dump->lock);
+	pthread_cond_destroy(&dump->cond);
+}
+
+#endif
@@ -1,16 +1,79 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <expat.h>
 #include <expat_external.h>
+#include "dump.h"
 
 #include <stdbool.h>
 
+// Number of bytes of the dump given to a thread at once, when extracting on
+// several threads
+#define CHUNK_SIZE 0x400000
+
+// Maximum number of threads
+#define MAX_THREADS 256
+
 typedef struct Data
 {
 	int depth;
 	bool in_text;
 	int text_depth;
+	char *out;
+	size_t out_length;
+	size_t out_size;
 } Data;
 
+// A run of whole pages of the dump, and its position in the dump
+typedef struct Chunk
+{
+	char *data;
+	size_t length;
+	size_t size;
+	int index;
+	long long offset;
+} Chunk;
+
+// Part of the dump read past the last complete page, and the position of the
+// next chunk
+static char *pending;
+static size_t pending_length;
+static size_t pending_size;
+static int next_chunk;
+static long long next_offset;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Index of the next chunk to be written out
+static int next_output;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
+
+// Input, which may be compressed
+static struct dump_t dump;
+
+void *growBuffer(char *buffer, size_t *size, size_t needed)
+{
+	if (needed <= *size)
+		return buffer;
+	while (*size < needed)
+		*size = *size ? *size * 2 : CHUNK_SIZE;
+	buffer = realloc(buffer, *size);
+	if (!buffer) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return buffer;
+}
+
+void output(Data *data, const char *s, size_t len)
+{
+	data->out = growBuffer(data->out, &data->out_size, data->out_length + len);
+	memcpy(data->out + data->out_length, s, len);
+	data->out_length += len;
+}
+
 void startElement(void *userData, const char *name, const char **atts)
 {
 	int i;
@@ -34,33 +97,194 @@ void endElement(void *userData, const char *name)
 	if (data->in_text && (data->depth == data->text_depth))
 	{
 		data->in_text = false;
-		putchar(0x1C);
+		output(data, "\x1C", 1);
 		// puts("o");
 	}
-	
+
 }
 
 void charHandler(void *userData, const char *s, int len)
 {
-	Data *data = userData;	
-	int i;
+	Data *data = userData;
 	if (data->in_text)
-		for (i = 0; i < len; i++)
-			putchar(s[i]);
+		output(data, s, len);
 }
 
-int main()
+// Find the first or last occurrence of a tag in a buffer
+const char *findTag(const char *buffer, size_t length, const char *tag, bool last)
+{
+	size_t tag_length = strlen(tag);
+	if (length < tag_length)
+		return NULL;
+
+	size_t i;
+	if (last) {
+		for (i = length - tag_length + 1; i-- > 0;)
+			if (buffer[i] == '<' && !memcmp(buffer + i, tag, tag_length))
+				return buffer + i;
+		return NULL;
+	}
+
+	const char *p = buffer;
+	const char *end = buffer + length - tag_length + 1;
+	while ((p = memchr(p, '<', end - p))) {
+		if (!memcmp(p, tag, tag_length))
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+// Read the next run of whole pages from the standard input. Whatever follows
+// the last complete page is kept for the next chunk. Returns false once there
+// are no pages left.
+bool readChunk(Chunk *chunk)
+{
+	pthread_mutex_lock(&input_lock);
+	chunk->data = growBuffer(chunk->data, &chunk->size, pending_length + CHUNK_SIZE);
+	memcpy(chunk->data, pending, pending_length);
+	chunk->length = pending_length;
+	chunk->offset = next_offset;
+
+	// Fill the chunk, and keep reading if it doesn't hold a complete page
+	const char *end;
+	for (;;) {
+		chunk->length += dump_read(&dump, chunk->data + chunk->length, chunk->size - chunk->length);
+		end = findTag(chunk->data, chunk->length, "</page>", true);
+		if (end || chunk->length < chunk->size)
+			break;
+		chunk->data = growBuffer(chunk->data, &chunk->size, chunk->size + 1);
+	}
+
+	// Keep the rest for the next chunk
+	const char *start = findTag(chunk->data, chunk->length, "<page>", false);
+	size_t length = end ? end + strlen("</page>") - chunk->data : 0;
+	if (!end && start) {
+		fprintf(stderr, "Truncated page at byte %lld\n", next_offset + (long long)(start - chunk->data));
+		exit(1);
+	}
+	pending_length = chunk->length - length;
+	pending = growBuffer(pending, &pending_size, pending_length);
+	memcpy(pending, chunk->data + length, pending_length);
+	next_offset += length;
+
+	// Skip whatever comes before the first page
+	if (start) {
+		memmove(chunk->data, start, length - (start - chunk->data));
+		chunk->offset += start - chunk->data;
+		length -= start - chunk->data;
+	}
+	chunk->length = length;
+	chunk->index = next_chunk++;
+	pthread_mutex_unlock(&input_lock);
+	return length != 0;
+}
+
+// Extraction thread, parses chunks of the dump with a parser of its own and
+// writes out their text in order
+void *worker(void *arg)
+{
+	Chunk chunk = {NULL, 0, 0, 0, 0};
+	Data data = {0, false, 0, NULL, 0, 0};
+	(void)arg;
+
+	while (readChunk(&chunk)) {
+		// Pages are wrapped in an element of their own, so that each chunk is
+		// a document
+		XML_Parser parser = XML_ParserCreate(NULL);
+		data.depth = 0;
+		data.in_text = false;
+		data.out_length = 0;
+		XML_SetUserData(parser, &data);
+		XML_SetElementHandler(parser, startElement, endElement);
+		XML_SetCharacterDataHandler(parser, charHandler);
+		if (!XML_Parse(parser, "<pages>", 7, 0) ||
+		    !XML_Parse(parser, chunk.data, chunk.length, 0) ||
+		    !XML_Parse(parser, "</pages>", 8, 1)) {
+			fprintf(stderr,
+			        "%s at byte %lld\n",
+			        XML_ErrorString(XML_GetErrorCode(parser)),
+			        chunk.offset + (long long)XML_GetCurrentByteIndex(parser) - 7);
+			exit(1);
+		}
+		XML_ParserFree(parser);
+
+		// Wait for our turn to write the text out
+		pthread_mutex_lock(&output_lock);
+		while (next_output != chunk.index)
+			pthread_cond_wait(&output_cond, &output_lock);
+		pthread_mutex_unlock(&output_lock);
+
+		fwrite(data.out, 1, data.out_length, stdout);
+
+		pthread_mutex_lock(&output_lock);
+		next_output++;
+		pthread_cond_broadcast(&output_cond);
+		pthread_mutex_unlock(&output_lock);
+	}
+
+	free(chunk.data);
+	free(data.out);
+	return NULL;
+}
+
+// Extract the text of the pages of a dump on several threads. The text is
+// written out in the same order as with a single parser.
+int extractParallel(int num_threads)
+{
+	pthread_t threads[MAX_THREADS];
+	int i;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			fprintf(stderr, "Error creating extraction thread\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	return 0;
+}
+
+int main(int argc, char **argv)
 {
 	char buf[BUFSIZ];
-	XML_Parser parser = XML_ParserCreate(NULL);
+	XML_Parser parser;
 	int done;
-	Data data = {0, false, 0};
+	Data data = {0, false, 0, NULL, 0, 0};
+	int num_threads = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_threads = atoi(optarg);
+			if (num_threads < 1 || num_threads > MAX_THREADS) {
+				fprintf(stderr, "Number of threads must be between 1 and %d\n", MAX_THREADS);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-j threads]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// With several threads the dump is split between pages, so anything
+	// outside of them is ignored. Compressed dumps are decompressed with as
+	// many threads.
+	dump_open(&dump, stdin, num_threads);
+	if (num_threads > 1) {
+		int result = extractParallel(num_threads);
+		dump_close(&dump);
+		return result;
+	}
 
+	parser = XML_ParserCreate(NULL);
 	XML_SetUserData(parser, &data);
 	XML_SetElementHandler(parser, startElement, endElement);
 	XML_SetCharacterDataHandler(parser, charHandler);
 	do {
-		size_t len = fread(buf, 1, sizeof(buf), stdin);
+		size_t len = dump_read(&dump, buf, sizeof(buf));
 		done = len < sizeof(buf);
 		if (!XML_Parse(parser, buf, len, done)) {
 			fprintf(stderr,
@@ -69,7 +293,10 @@ int main()
 			        XML_GetCurrentLineNumber(parser));
 			return 1;
 		}
+		fwrite(data.out, 1, data.out_length, stdout);
+		data.out_length = 0;
 	} while (!done);
 	XML_ParserFree(parser);
+	dump_close(&dump);
 	return 0;
 }
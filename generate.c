@@ -4,51 +4,195 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "markov.h"
+#include "math.h"
+#include "model.h"
+#include "rng.h"
+#include "trace.h"
 
-// Initial size of the string buffer when generating strings
-#define MARKOV_GENERATE_BUFFER_SIZE 512
+// Number of sentences generated as one unit of work in batch mode. Each block
+// has its own random stream, so the output only depends on the seed.
+#define MARKOV_BLOCK_SENTENCES 4096
 
-// Memory-mapped database files
-static char *stringdb;
-static void *markovdb;
-static markov_offset_t markovdb_length;
-static struct markov_export_start_t *startdb;
+// Maximum number of generator threads
+#define MARKOV_MAX_THREADS 256
 
-// Memory map a file
-static inline void *mmap_file(const char *file, int64_t *length_ptr)
-{
-	// Open the file
-	int fd = open(file, O_RDONLY);
-	if (fd == -1) {
-		printf("Error opening file %s: %s\n", file, strerror(errno));
-		exit(1);
-	}
+// Maximum number of client connections the server keeps open
+#define MARKOV_SERVER_MAX_CONNECTIONS 1024
 
-	// Get the file length
-	struct stat buf;
-	fstat(fd, &buf);
-	markov_offset_t length = buf.st_size;
+// Size of the request buffer of a server connection, which limits the length
+// of a request line
+#define MARKOV_SERVER_REQUEST_SIZE 256
 
-	// Make sure length fits in our address space
-	if (sizeof(void *) == 4 && length > 0xFFFFFFFF)
-		printf("Warning: File too big for 32bit address space\n");
+// Maximum number of connections a server thread takes from the queue at once
+#define MARKOV_SERVER_BATCH 16
 
-	if (length_ptr)
-		*length_ptr = length;
+// Maximum number of sentences in one server request
+#define MARKOV_SERVER_MAX_SENTENCES 1000000
 
-	// Memory map the file
-	void *ptr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		printf("Error mmaping file %s: %s\n", file, strerror(errno));
-		exit(1);
+// Size of the responses after which a server thread stops answering the
+// requests of a connection. The remaining ones are answered once the client
+// has read what it was sent.
+#define MARKOV_SERVER_MAX_OUTPUT 0x100000
+
+// A memory-mapped model file, and its sections
+struct markov_db_t {
+	struct model_t model;
+	char *stringdb;
+	void *markovdb;
+	struct markov_export_start_t *startdb;
+	bool has_alias;
+};
+
+// Model used for new work. In server mode it can be replaced while requests
+// are being served, and the old model is unmapped once no server thread uses
+// it anymore.
+static struct markov_db_t *markov_current;
+static const char *markov_model_file;
+static bool markov_model_verify = true;
+
+// How the model is brought into memory when it is mapped. With populate the
+// whole model is read in and mapped before the first sentence, which then
+// never waits for a page fault. With will need the kernel starts reading it in
+// the background, and generation starts right away. Both only matter when the
+// checksums are not verified, since that reads the whole model anyway.
+static bool markov_model_populate;
+static bool markov_model_will_need;
+
+// Sections of the model used by the current thread
+static __thread char *stringdb;
+static __thread void *markovdb;
+static __thread struct markov_export_start_t *startdb;
+
+// Whether to sample exits using the alias tables in the database, and whether
+// that was disabled on the command line
+static __thread bool markov_use_alias;
+static bool markov_no_alias;
+
+// A growable output buffer
+struct markov_buffer_t {
+	char *data;
+	size_t length;
+	size_t size;
+};
+
+// A growable list of pieces of output, which point directly into the string
+// database so that words are never copied before being written
+struct markov_iovec_t {
+	struct iovec *iov;
+	int count;
+	int size;
+};
+
+// Separators between words and sentences
+static char markov_space[] = " ";
+static char markov_newline[] = "\n\n";
+
+// Batch mode settings. By default each block is copied into a buffer and
+// written at once. With writev, words are written straight from the string
+// database instead, which avoids the copy but costs more per word in the
+// kernel.
+static int64_t markov_batch_sentences;
+static int64_t markov_batch_blocks;
+static uint64_t markov_seed;
+static bool markov_batch_writev;
+
+// Next block to generate, and next block to write out. Blocks are written in
+// order, so the output does not depend on the number of threads.
+static int64_t markov_next_block;
+static int64_t markov_next_output_block;
+static pthread_mutex_t markov_output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markov_output_cond = PTHREAD_COND_INITIALIZER;
+
+// A client connection of the server. A request is a line with a number of
+// sentences and an optional seed. The response is the length of the generated
+// text on its own line followed by the text, one sentence per line, or a line
+// starting with "ERR" if the request is invalid. A request with a seed always
+// gets the same sentences as batch mode with that seed. A "RELOAD" request
+// reloads the model in the background and is answered with "OK". Sockets are
+// non-blocking, and the part of the responses the client has not taken yet is
+// kept in pending, of which the first sent bytes have been written.
+struct markov_connection_t {
+	int fd;
+	int length;
+	char request[MARKOV_SERVER_REQUEST_SIZE];
+	struct markov_buffer_t pending;
+	size_t sent;
+};
+
+// Connections with pending requests, waiting for a server thread, and
+// connections which have been served, waiting to be polled again. A pipe wakes
+// up the polling thread when connections are handed back to it.
+static struct markov_connection_t *markov_server_queue[MARKOV_SERVER_MAX_CONNECTIONS];
+static int markov_server_queue_head;
+static int markov_server_queue_count;
+static struct markov_connection_t *markov_server_served[MARKOV_SERVER_MAX_CONNECTIONS];
+static int markov_server_num_served;
+static int markov_server_num_connections;
+static int markov_server_wakeup[2];
+static pthread_mutex_t markov_server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markov_server_cond = PTHREAD_COND_INITIALIZER;
+
+// Epochs of the server threads, used to find out when an old model can be
+// unmapped. A thread publishes the current epoch before it picks up the model
+// and clears it as soon as it has generated the responses of a connection.
+// Responses are copied out of the model, so they are written without an epoch
+// and a slow client never holds up a reload.
+static uint64_t markov_server_epoch = 1;
+static uint64_t markov_server_epochs[MARKOV_MAX_THREADS];
+static int markov_server_num_threads;
+
+// Whether a model reload was requested, and whether one is running
+static volatile sig_atomic_t markov_reload_pending;
+static bool markov_reloading;
+
+// Map a model and find its sections. Returns NULL with a message in the model
+// if it can't be used.
+static inline struct markov_db_t *markov_load(struct model_t *error)
+{
+	struct markov_db_t *db = malloc(sizeof(struct markov_db_t));
+	assert(db);
+	int flags = markov_model_populate ? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+	if (!model_try_map(&db->model, markov_model_file, PROT_READ, flags, markov_model_verify)) {
+		*error = db->model;
+		free(db);
+		return NULL;
 	}
+	if (markov_model_will_need)
+		model_advise(&db->model, MADV_WILLNEED);
 
-	return ptr;
+	db->stringdb = model_section(&db->model, MARKOV_SECTION_STRINGS);
+	db->markovdb = model_section(&db->model, MARKOV_SECTION_NODES);
+	db->startdb = model_section(&db->model, MARKOV_SECTION_START);
+	db->has_alias = db->model.header->flags & MARKOV_FLAG_ALIAS;
+
+	// A model pruned down to nothing has no sentence to start
+	if (!(db->startdb->num_start_states & ~MARKOV_EXITS_WIDE)) {
+		snprintf(error->error, sizeof(error->error), "Model %s has no start states", markov_model_file);
+		model_unmap(&db->model);
+		free(db);
+		return NULL;
+	}
+	return db;
+}
+
+// Make the current thread generate from a model
+static inline void markov_use_db(struct markov_db_t *db)
+{
+	stringdb = db->stringdb;
+	markovdb = db->markovdb;
+	startdb = db->startdb;
+	markov_use_alias = db->has_alias && !markov_no_alias;
 }
 
 // Get a string from its offset
@@ -60,20 +204,80 @@ static inline const char *get_string(string_offset_t offset)
 		return stringdb + offset;
 }
 
+// Get the length of a string from its offset
+static inline string_length_t get_string_length(string_offset_t offset)
+{
+	string_length_t length;
+	memcpy(&length, stringdb + offset - sizeof(string_length_t), sizeof(string_length_t));
+	return length;
+}
+
 // Get a node from its offset
 static inline struct markov_export_node_t *get_node(markov_offset_t offset)
 {
 	return (struct markov_export_node_t *)(markovdb + offset);
 }
 
+// Check if a sentence ends at a node. A node without exits which does not end
+// a sentence can only come from a model pruned by an older trainer, and then
+// cuts the sentence short.
+static inline bool markov_sentence_end(struct markov_export_node_t *node)
+{
+	return node->strings[MARKOV_ORDER-1] == -1 || !(node->num_exits & ~MARKOV_EXITS_WIDE);
+}
+
+// Picks a random exit state in constant time using the alias table which
+// follows the exits.
+static inline struct markov_export_node_t *markov_generate_next_state_alias(struct rng_t *rng, uint32_t num_exits, struct markov_export_exit_t *exits)
+{
+	int exit_size = markov_exit_size(num_exits);
+	num_exits &= ~MARKOV_EXITS_WIDE;
+	struct markov_export_alias_t *alias = (struct markov_export_alias_t *)((char *)exits + exit_size * num_exits);
+
+	// The high half of the random number picks an entry, the low half
+	// decides between the entry and its alias.
+	uint64_t random = rng_next(rng);
+	uint32_t index = ((random >> 32) * num_exits) >> 32;
+	if ((uint32_t)random >= alias[index].probability)
+		index = alias[index].alias;
+
+	// The node offset comes first in both kinds of exits
+	return get_node(((struct markov_export_exit_t *)((char *)exits + exit_size * index))->node);
+}
+
+// Picks a random exit state from exits with 64-bit counts
+static inline struct markov_export_node_t *markov_generate_next_state_wide(struct rng_t *rng, uint32_t num_exits, struct markov_export_wide_exit_t *exits)
+{
+	uint64_t frequency_threshold = rng_next(rng) % (exits[num_exits - 1].count + 1);
+
+	uint32_t half;
+	struct markov_export_wide_exit_t *middle;
+	while (num_exits) {
+		half = num_exits / 2;
+		middle = exits + half;
+		if (middle->count < frequency_threshold) {
+			exits = middle + 1;
+			num_exits = num_exits - half - 1;
+		} else
+			num_exits = half;
+	}
+
+	return get_node(exits->node);
+}
+
 // Picks a random exit state, taking into account weightings based on frequency.
-static inline struct markov_export_node_t *markov_generate_next_state(int num_exits, struct markov_export_exit_t *exits)
+static inline struct markov_export_node_t *markov_generate_next_state(struct rng_t *rng, uint32_t num_exits, struct markov_export_exit_t *exits)
 {
+	if (markov_use_alias)
+		return markov_generate_next_state_alias(rng, num_exits, exits);
+	if (num_exits & MARKOV_EXITS_WIDE)
+		return markov_generate_next_state_wide(rng, num_exits & ~MARKOV_EXITS_WIDE, (struct markov_export_wide_exit_t *)exits);
+
 	// Determine the frequencry threshold
-	int frequency_threshold = rand() % (exits[num_exits - 1].count + 1);
+	uint32_t frequency_threshold = rng_next(rng) % ((uint64_t)exits[num_exits - 1].count + 1);
 
 	// Use a binary search to find the exit we are looking for
-	int half;
+	uint32_t half;
 	struct markov_export_exit_t *middle;
 	while (num_exits) {
 		half = num_exits / 2;
@@ -88,81 +292,732 @@ static inline struct markov_export_node_t *markov_generate_next_state(int num_ex
 	return get_node(exits->node);
 }
 
-// Appends a node's contents to a given buffer and returns a pointer to the
-// buffer incase it is extended.
-static inline char *markov_append_node_to_string(char *old_str,
-                                                 int *buffer_size,
-                                                 struct markov_export_node_t *node,
-                                                 int only_print_last)
+// Add a piece of output to an iovec list
+static inline void markov_iovec_append(struct markov_iovec_t *list, char *data, size_t length)
 {
-	// The index to start printing the strings in the node from
-	int print_from = only_print_last * (MARKOV_ORDER - 1);
+	if (list->count == list->size) {
+		list->size = max(list->size * 2, 256);
+		list->iov = realloc(list->iov, sizeof(struct iovec) * list->size);
+		assert(list->iov);
+	}
+	list->iov[list->count].iov_base = data;
+	list->iov[list->count].iov_len = length;
+	list->count++;
+}
 
-	// Find the new required length for the string incase the buffer needs
-	// extending
-	size_t new_length;
-	new_length = strlen(old_str);
+// Add the strings of a node to an iovec list, separated by spaces
+static inline void markov_iovec_append_node(struct markov_iovec_t *list, struct markov_export_node_t *node, int print_from, bool first)
+{
 	int i;
 	for (i = print_from; i < MARKOV_ORDER; i++) {
-		if (node->strings[i] != -1)
-			new_length += strlen(get_string(node->strings[i])) + 1;
+		if (node->strings[i] != -1) {
+			if (!first)
+				markov_iovec_append(list, markov_space, 1);
+			first = false;
+			markov_iovec_append(list, stringdb + node->strings[i], get_string_length(node->strings[i]));
+		}
+	}
+}
+
+// Generate a sentence into an iovec list, followed by a newline. Use two
+// newlines to leave an empty line after the sentence.
+static inline void markov_generate_iovec(struct rng_t *rng, struct markov_iovec_t *list, int newlines)
+{
+	struct markov_export_node_t *current_node = markov_generate_next_state(rng, startdb->num_start_states, startdb->start_states);
+	markov_iovec_append_node(list, current_node, 0, true);
+	while (!markov_sentence_end(current_node)) {
+		current_node = markov_generate_next_state(rng, current_node->num_exits, current_node->exits);
+		markov_iovec_append_node(list, current_node, MARKOV_ORDER - 1, false);
+	}
+	markov_iovec_append(list, markov_newline, newlines);
+}
+
+// Write all the pieces of an iovec list to a file descriptor, and empty the
+// list
+static inline void writev_all(int fd, struct markov_iovec_t *list)
+{
+	struct iovec *iov = list->iov;
+	int count = list->count;
+	while (count) {
+		ssize_t written = writev(fd, iov, min(count, IOV_MAX));
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		// Skip the pieces which were written completely and adjust the
+		// first one which was only partially written
+		while (count && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
 	}
+	list->count = 0;
+}
+
+// Walk a random sentence through the model without building any output.
+// Returns the number of nodes visited.
+static inline int markov_walk(struct rng_t *rng)
+{
+	struct markov_export_node_t *current_node = markov_generate_next_state(rng, startdb->num_start_states, startdb->start_states);
+	int length = 1;
+	while (!markov_sentence_end(current_node)) {
+		current_node = markov_generate_next_state(rng, current_node->num_exits, current_node->exits);
+		length++;
+	}
+
+	return length;
+}
+
+// Time the walk of a number of sentences with the current sampler
+static inline void markov_benchmark(const char *name, int num_sentences)
+{
+	struct trace_span_t span;
+	trace_begin(&span, name);
+	struct rng_t rng;
+	rng_seed(&rng, markov_seed);
+	double start = get_time();
+	int64_t num_nodes = 0;
+	int i;
+	for (i = 0; i < num_sentences; i++)
+		num_nodes += markov_walk(&rng);
+	double elapsed = get_time() - start;
+	trace_end(&span);
 
-	char *new_str;
+	printf("%s: %d sentences, %lld nodes in %.3fs, %.1f ns/node, %.0f nodes/s\n",
+	       name, num_sentences, (long long)num_nodes, elapsed,
+	       elapsed * 1e9 / num_nodes, num_nodes / elapsed);
+}
 
-	if ((int)new_length + 1 > *buffer_size) {
-		// If the new length is too big, double the buffer size
-		(*buffer_size) *= 2;
-		new_str = realloc(old_str, *buffer_size);
-	} else {
-		new_str = old_str;
+// Append data to an output buffer, growing it if needed
+static inline void markov_buffer_append(struct markov_buffer_t *buffer, const char *data, size_t length)
+{
+	if (buffer->length + length > buffer->size) {
+		buffer->size = max(buffer->size * 2, buffer->length + length);
+		buffer->data = realloc(buffer->data, buffer->size);
+		assert(buffer->data);
 	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
 
-	// Concatenate the new node's strings onto the end
+// Append the strings of a node to an output buffer, separated by spaces
+static inline void markov_buffer_append_node(struct markov_buffer_t *buffer, struct markov_export_node_t *node, int print_from)
+{
+	int i;
 	for (i = print_from; i < MARKOV_ORDER; i++) {
 		if (node->strings[i] != -1) {
-			strcat(new_str, get_string(node->strings[i]));
-			strcat(new_str, " ");
+			if (buffer->length && buffer->data[buffer->length - 1] != '\n')
+				markov_buffer_append(buffer, " ", 1);
+			markov_buffer_append(buffer, get_string(node->strings[i]), get_string_length(node->strings[i]));
+		}
+	}
+}
+
+// Generate a sentence into an output buffer, followed by a newline
+static inline void markov_generate_into(struct rng_t *rng, struct markov_buffer_t *buffer)
+{
+	struct markov_export_node_t *current_node = markov_generate_next_state(rng, startdb->num_start_states, startdb->start_states);
+	markov_buffer_append_node(buffer, current_node, 0);
+	while (!markov_sentence_end(current_node)) {
+		current_node = markov_generate_next_state(rng, current_node->num_exits, current_node->exits);
+		markov_buffer_append_node(buffer, current_node, MARKOV_ORDER - 1);
+	}
+	markov_buffer_append(buffer, "\n", 1);
+}
+
+// Write a whole buffer to a file descriptor
+static inline void write_all(int fd, const char *data, size_t length)
+{
+	while (length) {
+		ssize_t written = write(fd, data, length);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+			exit(1);
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+// Batch mode thread, generates blocks of sentences until all have been done
+static void *markov_batch_worker(void *arg)
+{
+	trace_thread_name("generator %d", (int)(intptr_t)arg);
+	markov_use_db(markov_current);
+
+	struct markov_buffer_t buffer = {NULL, 0, 0};
+	struct markov_iovec_t list = {NULL, 0, 0};
+	while (true) {
+		int64_t block = __sync_fetch_and_add(&markov_next_block, 1);
+		if (block >= markov_batch_blocks)
+			break;
+
+		// Generate all the sentences of this block
+		struct trace_span_t span;
+		trace_begin(&span, "generate");
+		struct rng_t rng;
+		rng_seed_stream(&rng, markov_seed, block);
+		int64_t num_sentences = min(MARKOV_BLOCK_SENTENCES, markov_batch_sentences - block * MARKOV_BLOCK_SENTENCES);
+		int64_t i;
+		buffer.length = 0;
+		for (i = 0; i < num_sentences; i++) {
+			if (markov_batch_writev)
+				markov_generate_iovec(&rng, &list, 1);
+			else
+				markov_generate_into(&rng, &buffer);
+		}
+		trace_end(&span);
+
+		// Wait for our turn to write the block out
+		pthread_mutex_lock(&markov_output_lock);
+		while (markov_next_output_block != block)
+			pthread_cond_wait(&markov_output_cond, &markov_output_lock);
+		pthread_mutex_unlock(&markov_output_lock);
+
+		trace_begin(&span, "write");
+		if (markov_batch_writev)
+			writev_all(STDOUT_FILENO, &list);
+		else
+			write_all(STDOUT_FILENO, buffer.data, buffer.length);
+		trace_end(&span);
+
+		pthread_mutex_lock(&markov_output_lock);
+		markov_next_output_block++;
+		pthread_cond_broadcast(&markov_output_cond);
+		pthread_mutex_unlock(&markov_output_lock);
+	}
+
+	free(buffer.data);
+	free(list.iov);
+	return NULL;
+}
+
+// Generate a number of sentences on several threads, one sentence per line
+static inline void markov_batch(int64_t num_sentences, int num_threads)
+{
+	markov_batch_sentences = num_sentences;
+	markov_batch_blocks = (num_sentences + MARKOV_BLOCK_SENTENCES - 1) / MARKOV_BLOCK_SENTENCES;
+
+	pthread_t threads[MARKOV_MAX_THREADS];
+	int i;
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, markov_batch_worker, (void *)(intptr_t)i)) {
+			fprintf(stderr, "Error creating generator thread\n");
+			exit(1);
 		}
 	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+}
 
-	return new_str;
+// Generate the sentences of one block of a batch into an output buffer
+static inline void markov_generate_block(struct markov_buffer_t *buffer, uint64_t seed, int64_t block, int64_t num_sentences)
+{
+	struct rng_t rng;
+	rng_seed_stream(&rng, seed, block);
+	int64_t i;
+	for (i = 0; i < num_sentences; i++)
+		markov_generate_into(&rng, buffer);
 }
 
-// Generate sentences using the current markov model
-static inline char *markov_generate()
+// Write as much of a buffer to a client as its socket takes. Returns the number
+// of bytes written, or -1 if the client went away.
+static inline ssize_t markov_server_write(int fd, const char *data, size_t length)
 {
-	// Create a buffer to put the output into
-	int buffer_size = MARKOV_GENERATE_BUFFER_SIZE;
-	char *output = malloc(MARKOV_GENERATE_BUFFER_SIZE);
-	*output = '\0';
+	size_t total = 0;
+	while (total < length) {
+		ssize_t written = write(fd, data + total, length - total);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		total += written;
+	}
+	return total;
+}
 
-	struct markov_export_node_t *start = markov_generate_next_state(startdb->num_start_states, startdb->start_states);
-	output = markov_append_node_to_string(output, &buffer_size, start, 0);
+// Send a response to a client, keeping what its socket does not take for
+// later. Returns false if the client went away.
+static inline bool markov_server_send(struct markov_connection_t *connection, const char *data, size_t length)
+{
+	ssize_t written = markov_server_write(connection->fd, data, length);
+	if (written == -1)
+		return false;
+	if ((size_t)written < length)
+		markov_buffer_append(&connection->pending, data + written, length - written);
+	return true;
+}
 
-	struct markov_export_node_t *current_node = start;
-	while (current_node->strings[MARKOV_ORDER-1] != -1) {
-		current_node = markov_generate_next_state(current_node->num_exits, current_node->exits);
-		output = markov_append_node_to_string(output, &buffer_size, current_node, 1);
+// Send the pending output of a connection, freeing it once it has all been
+// written. Returns false if the client went away.
+static inline bool markov_server_flush(struct markov_connection_t *connection)
+{
+	if (!connection->pending.length)
+		return true;
+	ssize_t written = markov_server_write(connection->fd, connection->pending.data + connection->sent, connection->pending.length - connection->sent);
+	if (written == -1)
+		return false;
+	connection->sent += written;
+	if (connection->sent == connection->pending.length) {
+		free(connection->pending.data);
+		connection->pending.data = NULL;
+		connection->pending.length = 0;
+		connection->pending.size = 0;
+		connection->sent = 0;
 	}
+	return true;
+}
 
-	return output;
+// Whether a connection has a complete request to answer, and no output left
+// to send first
+static inline bool markov_server_ready(struct markov_connection_t *connection)
+{
+	return !connection->pending.length && memchr(connection->request, '\n', connection->length);
+}
+
+// Close a connection
+static inline void markov_server_close(struct markov_connection_t *connection)
+{
+	close(connection->fd);
+	free(connection->pending.data);
+	free(connection);
+	__sync_fetch_and_sub(&markov_server_num_connections, 1);
+}
+
+// Answer a single request, appending the response to an output buffer. The
+// text is generated in a separate buffer since its length comes first.
+static inline void markov_server_request(const char *request, struct markov_buffer_t *output, struct markov_buffer_t *text, struct rng_t *rng)
+{
+	if (!strcmp(request, "RELOAD")) {
+		static const char ok[] = "OK\n";
+		markov_reload_pending = 1;
+		while (write(markov_server_wakeup[1], "", 1) == -1 && errno == EINTR);
+		markov_buffer_append(output, ok, sizeof(ok) - 1);
+		return;
+	}
+
+	long long num_sentences;
+	unsigned long long seed;
+	int fields = sscanf(request, "%lld %llu", &num_sentences, &seed);
+	if (fields < 1 || num_sentences < 1 || num_sentences > MARKOV_SERVER_MAX_SENTENCES) {
+		static const char error[] = "ERR invalid request\n";
+		markov_buffer_append(output, error, sizeof(error) - 1);
+		return;
+	}
+	if (fields < 2)
+		seed = rng_next(rng);
+
+	text->length = 0;
+	int64_t block;
+	for (block = 0; block * MARKOV_BLOCK_SENTENCES < num_sentences; block++)
+		markov_generate_block(text, seed, block, min(MARKOV_BLOCK_SENTENCES, num_sentences - block * MARKOV_BLOCK_SENTENCES));
+
+	char header[32];
+	int length = snprintf(header, sizeof(header), "%zu\n", text->length);
+	markov_buffer_append(output, header, length);
+	markov_buffer_append(output, text->data, text->length);
+}
+
+// Read from a connection and answer the complete requests received so far
+// into an output buffer. Returns false if the connection should be closed.
+static inline bool markov_server_serve(struct markov_connection_t *connection, struct markov_buffer_t *output, struct markov_buffer_t *text, struct rng_t *rng)
+{
+	// A full buffer holds complete requests, which are answered first
+	if (connection->length < MARKOV_SERVER_REQUEST_SIZE) {
+		ssize_t received = read(connection->fd, connection->request + connection->length, MARKOV_SERVER_REQUEST_SIZE - connection->length);
+		if (received == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+		if (!received)
+			return false;
+		if (received > 0)
+			connection->length += received;
+	}
+
+	// Answer the complete lines, until the responses get too large
+	output->length = 0;
+	char *line = connection->request;
+	char *end;
+	while (output->length < MARKOV_SERVER_MAX_OUTPUT && (end = memchr(line, '\n', connection->request + connection->length - line))) {
+		*end = '\0';
+		markov_server_request(line, output, text, rng);
+		line = end + 1;
+	}
+
+	// Keep the rest for later, unless it is an incomplete request which can
+	// never fit
+	connection->length -= line - connection->request;
+	memmove(connection->request, line, connection->length);
+	return connection->length < MARKOV_SERVER_REQUEST_SIZE || memchr(connection->request, '\n', connection->length);
+}
+
+// Server thread. Takes batches of connections with pending requests, serves
+// them, and hands them back to the polling thread all at once.
+static void *markov_server_worker(void *arg)
+{
+	int index = (uintptr_t)arg;
+
+	// Requests without a seed get one from a per-thread generator
+	struct rng_t rng;
+	rng_seed_stream(&rng, markov_seed, index);
+
+	struct markov_buffer_t output = {NULL, 0, 0};
+	struct markov_buffer_t text = {NULL, 0, 0};
+	while (true) {
+		struct markov_connection_t *batch[MARKOV_SERVER_BATCH];
+		int num_batch = 0;
+		pthread_mutex_lock(&markov_server_lock);
+		while (!markov_server_queue_count)
+			pthread_cond_wait(&markov_server_cond, &markov_server_lock);
+		while (markov_server_queue_count && num_batch < MARKOV_SERVER_BATCH) {
+			batch[num_batch++] = markov_server_queue[markov_server_queue_head];
+			markov_server_queue_head = (markov_server_queue_head + 1) % MARKOV_SERVER_MAX_CONNECTIONS;
+			markov_server_queue_count--;
+		}
+		pthread_mutex_unlock(&markov_server_lock);
+
+		int i;
+		for (i = 0; i < num_batch; i++) {
+			// No more requests are answered until the client has taken
+			// the earlier responses
+			bool open = markov_server_flush(batch[i]);
+			if (open && !batch[i]->pending.length) {
+				// Pick up the current model for these requests. The
+				// epoch has to be visible before the model pointer is
+				// read.
+				__atomic_store_n(&markov_server_epochs[index], __atomic_load_n(&markov_server_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+				markov_use_db(__atomic_load_n(&markov_current, __ATOMIC_SEQ_CST));
+				open = markov_server_serve(batch[i], &output, &text, &rng);
+				__atomic_store_n(&markov_server_epochs[index], 0, __ATOMIC_SEQ_CST);
+
+				if (open)
+					open = markov_server_send(batch[i], output.data, output.length);
+			}
+			if (!open) {
+				markov_server_close(batch[i]);
+				batch[i] = NULL;
+			}
+		}
+
+		pthread_mutex_lock(&markov_server_lock);
+		for (i = 0; i < num_batch; i++) {
+			if (batch[i])
+				markov_server_served[markov_server_num_served++] = batch[i];
+		}
+		pthread_mutex_unlock(&markov_server_lock);
+		while (write(markov_server_wakeup[1], "", 1) == -1 && errno == EINTR);
+	}
+
+	return NULL;
+}
+
+// Reload thread. Maps and prefaults the new model before making it current, so
+// that requests never wait for it. The old model is unmapped once every server
+// thread has finished the requests it was answering when the model was
+// replaced.
+static void *markov_server_reload(void *arg)
+{
+	(void)arg;
+
+	struct trace_span_t span;
+	trace_begin(&span, "reload");
+	struct model_t error;
+	struct markov_db_t *db = markov_load(&error);
+	if (db) {
+		model_prefault(&db->model);
+		struct markov_db_t *old = __atomic_exchange_n(&markov_current, db, __ATOMIC_SEQ_CST);
+		uint64_t epoch = __atomic_add_fetch(&markov_server_epoch, 1, __ATOMIC_SEQ_CST);
+
+		// Wait until no thread is still in an epoch from before the swap
+		int i;
+		for (i = 0; i < markov_server_num_threads; i++) {
+			while (true) {
+				uint64_t thread_epoch = __atomic_load_n(&markov_server_epochs[i], __ATOMIC_SEQ_CST);
+				if (!thread_epoch || thread_epoch >= epoch)
+					break;
+				usleep(1000);
+			}
+		}
+
+		model_unmap(&old->model);
+		free(old);
+		fprintf(stderr, "Reloaded model %s\n", markov_model_file);
+	} else
+		fprintf(stderr, "Not reloading: %s\n", error.error);
+	trace_end(&span);
+
+	// Let the polling thread know, in case another reload was requested
+	pthread_mutex_lock(&markov_server_lock);
+	markov_reloading = false;
+	pthread_mutex_unlock(&markov_server_lock);
+	while (write(markov_server_wakeup[1], "", 1) == -1 && errno == EINTR);
+	return NULL;
+}
+
+// Signal handler requesting a model reload
+static void markov_reload_handler(int signal)
+{
+	(void)signal;
+	int saved_errno = errno;
+	markov_reload_pending = 1;
+	while (write(markov_server_wakeup[1], "", 1) == -1 && errno == EINTR);
+	errno = saved_errno;
+}
+
+// Listen for requests on a Unix domain socket, keeping the model mapped. The
+// calling thread polls the idle connections and queues the ones with pending
+// requests, or which can take more of their pending output, for the server
+// threads.
+static inline void markov_server(const char *path, int num_threads)
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	// Create the socket
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		exit(1);
+	}
+	strcpy(address.sun_path, path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+	if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) || listen(listen_fd, SOMAXCONN)) {
+		fprintf(stderr, "Error listening on %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (pipe2(markov_server_wakeup, O_CLOEXEC | O_NONBLOCK)) {
+		fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	// Reload the model on SIGHUP
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = markov_reload_handler;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &action, NULL);
+
+	// Start the server threads
+	markov_server_num_threads = num_threads;
+	int i;
+	for (i = 0; i < num_threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, markov_server_worker, (void *)(uintptr_t)i)) {
+			fprintf(stderr, "Error creating server thread\n");
+			exit(1);
+		}
+	}
+
+	struct markov_connection_t *idle[MARKOV_SERVER_MAX_CONNECTIONS];
+	struct pollfd fds[MARKOV_SERVER_MAX_CONNECTIONS + 2];
+	int num_idle = 0;
+	while (true) {
+		// Only accept new connections if there is room for them
+		fds[0].fd = markov_server_num_connections < MARKOV_SERVER_MAX_CONNECTIONS ? listen_fd : -1;
+		fds[0].events = POLLIN;
+		fds[1].fd = markov_server_wakeup[0];
+		fds[1].events = POLLIN;
+
+		// Connections with output left are only polled for writing, so
+		// that clients which do not read get no more work done for them.
+		// Connections which still have complete requests do not need to
+		// wait at all.
+		int timeout = -1;
+		for (i = 0; i < num_idle; i++) {
+			fds[i + 2].fd = idle[i]->fd;
+			fds[i + 2].events = idle[i]->pending.length ? POLLOUT : POLLIN;
+			if (markov_server_ready(idle[i]))
+				timeout = 0;
+		}
+		if (poll(fds, num_idle + 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error polling connections: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		// Queue the connections with pending requests
+		int num_polled = num_idle;
+		num_idle = 0;
+		pthread_mutex_lock(&markov_server_lock);
+		for (i = 0; i < num_polled; i++) {
+			if (fds[i + 2].revents || markov_server_ready(idle[i])) {
+				int tail = (markov_server_queue_head + markov_server_queue_count) % MARKOV_SERVER_MAX_CONNECTIONS;
+				markov_server_queue[tail] = idle[i];
+				markov_server_queue_count++;
+			} else
+				idle[num_idle++] = idle[i];
+		}
+		if (markov_server_queue_count)
+			pthread_cond_broadcast(&markov_server_cond);
+
+		// Take back the connections which have been served
+		if (fds[1].revents) {
+			char drain[256];
+			while (read(markov_server_wakeup[0], drain, sizeof(drain)) > 0);
+			for (i = 0; i < markov_server_num_served; i++)
+				idle[num_idle++] = markov_server_served[i];
+			markov_server_num_served = 0;
+		}
+
+		// Start a requested reload, unless one is already running. It is
+		// started again once the running one finishes.
+		bool reload = markov_reload_pending && !markov_reloading;
+		if (reload) {
+			markov_reload_pending = 0;
+			markov_reloading = true;
+		}
+		pthread_mutex_unlock(&markov_server_lock);
+		if (reload) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, markov_server_reload, NULL)) {
+				fprintf(stderr, "Error creating reload thread\n");
+				exit(1);
+			}
+			pthread_detach(thread);
+		}
+
+		// Accept a new connection
+		if (fds[0].revents) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (fd == -1)
+				continue;
+			struct markov_connection_t *connection = calloc(1, sizeof(struct markov_connection_t));
+			assert(connection);
+			connection->fd = fd;
+			idle[num_idle++] = connection;
+			__sync_fetch_and_add(&markov_server_num_connections, 1);
+		}
+	}
 }
 
 // Main function
-int main(void)
+int main(int argc, char **argv)
 {
-	// Read the databases
-	stringdb = mmap_file("stringdb", NULL);
-	markovdb = mmap_file("markovdb", &markovdb_length);
-	startdb = mmap_file("startdb", NULL);
+	markov_model_file = "model";
+	const char *socket_path = NULL;
+	int benchmark = 0;
+	int64_t batch = 0;
+	int num_threads = 1;
+	markov_seed = time(NULL);
+	int opt;
+	while ((opt = getopt(argc, argv, "b:km:nN:j:ps:S:t:wz")) != -1) {
+		switch (opt) {
+		case 'b':
+			benchmark = atoi(optarg);
+			break;
+		case 'k':
+			markov_model_verify = false;
+			break;
+		case 'm':
+			markov_model_file = optarg;
+			break;
+		case 'n':
+			markov_no_alias = true;
+			break;
+		case 'p':
+			markov_model_populate = true;
+			break;
+		case 'w':
+			markov_model_will_need = true;
+			break;
+		case 'N':
+			batch = atoll(optarg);
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			if (num_threads < 1 || num_threads > MARKOV_MAX_THREADS) {
+				printf("Number of threads must be between 1 and %d\n", MARKOV_MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 's':
+			markov_seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 't':
+			trace_open(optarg);
+			break;
+		case 'z':
+			markov_batch_writev = true;
+			break;
+		default:
+			printf("Usage: %s [-m model] [-k] [-n] [-p | -w] [-s seed] [-t trace] [-b sentences | -N sentences [-j threads] [-z] | -S socket [-j threads]]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// Read the model. Checking the section checksums can be skipped for a
+	// faster start.
+	struct model_t error;
+	struct trace_span_t span;
+	trace_thread_name("main", 0);
+	trace_begin(&span, "load");
+	markov_current = markov_load(&error);
+	if (!markov_current) {
+		printf("%s\n", error.error);
+		exit(1);
+	}
+	trace_end(&span);
+	markov_use_db(markov_current);
+	bool has_alias = markov_current->has_alias;
+
+	// Compare the samplers instead of generating sentences
+	if (benchmark) {
+		markov_use_alias = false;
+		markov_benchmark("Binary search", benchmark);
+		if (has_alias) {
+			markov_use_alias = true;
+			markov_benchmark("Alias table", benchmark);
+		} else
+			printf("No alias tables in the database, export with -a to compare\n");
+		trace_close();
+		return 0;
+	}
+
+	// Serve requests until killed
+	if (socket_path) {
+		markov_server(socket_path, num_threads);
+		return 0;
+	}
+
+	// Generate a fixed number of sentences without interaction
+	if (batch) {
+		markov_batch(batch, num_threads);
+		trace_close();
+		return 0;
+	}
 
 	// Generate strings until interrupted by a signal
+	struct rng_t rng;
+	rng_seed(&rng, markov_seed);
+	struct markov_iovec_t list = {NULL, 0, 0};
 	while (true) {
-		char *string = markov_generate();
-		printf("%s\n\n", string);
-		free(string);
-		while (getchar() != '\n') {}
+		markov_generate_iovec(&rng, &list, 2);
+		writev_all(STDOUT_FILENO, &list);
+
+		// Wait for a newline, stop at the end of input
+		int c;
+		while ((c = getchar()) != '\n') {
+			if (c == EOF)
+				return 0;
+		}
 	}
 
 	return 0;
@@ -2,6 +2,7 @@
 #define HASH_H_
 
 #include <stdint.h>
+#include <string.h>
 
 // djb2 hash function, from http://www.cse.yorku.ca/~oz/hash.html
 static inline int hash_string(const char *string)
@@ -22,16 +23,120 @@ static inline int hash_pointer(const void *ptr)
 	return value + (value >> 3);
 }
 
-// Hashes multiple strings. Since all strings are from the pool, just hash their
-// pointers. (from boost::hash)
-static inline int hash_strings(int num_strings, const char *const *strings)
+// Hashes multiple string ids. Ids are small consecutive integers, which
+// collide a lot with the boost combine function, so mix them into a 64-bit
+// state instead.
+static inline unsigned int hash_ids(int num_ids, const uint32_t *ids)
 {
-	int hash = 0;
+	uint64_t hash = 0;
 	int i;
 
-	for (i = 0; i < num_strings; i++)
-		hash ^= hash_pointer(strings[i]) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	for (i = 0; i < num_ids; i++)
+		hash = (hash ^ ids[i]) * 0x9e3779b97f4a7c15ull;
 
+	return hash ^ (hash >> 32);
+}
+
+// Finalization mix from MurmurHash3. Spreads the entropy of a hash over all of
+// its bits, so that both the low and high bits can be used as an index.
+static inline unsigned int hash_mix(unsigned int hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+// Constants of the XXH64 hash function
+#define HASH_PRIME64_1 0x9e3779b185ebca87ull
+#define HASH_PRIME64_2 0xc2b2ae3d27d4eb4full
+#define HASH_PRIME64_3 0x165667b19e3779f9ull
+#define HASH_PRIME64_4 0x85ebca77c2b2ae63ull
+#define HASH_PRIME64_5 0x27d4eb2f165667c5ull
+
+// Rotate a 64-bit value left
+static inline uint64_t hash_rotl64(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+// Mix 8 bytes of input into an XXH64 accumulator
+static inline uint64_t hash_round64(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH_PRIME64_2;
+	acc = hash_rotl64(acc, 31);
+	return acc * HASH_PRIME64_1;
+}
+
+// Read an unaligned little-endian 64-bit value
+static inline uint64_t hash_read64(const unsigned char *data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+// Read an unaligned little-endian 32-bit value
+static inline uint32_t hash_read32(const unsigned char *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+// Checksum a block of data with XXH64 (seed 0), from
+// https://github.com/Cyan4973/xxHash. It runs at memory speed, so checking a
+// whole model costs little more than reading it.
+static inline uint64_t hash_checksum(const void *ptr, uint64_t length)
+{
+	const unsigned char *data = ptr;
+	const unsigned char *end = data + length;
+	uint64_t hash;
+
+	if (length >= 32) {
+		uint64_t v1 = HASH_PRIME64_1 + HASH_PRIME64_2;
+		uint64_t v2 = HASH_PRIME64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -HASH_PRIME64_1;
+		do {
+			v1 = hash_round64(v1, hash_read64(data));
+			v2 = hash_round64(v2, hash_read64(data + 8));
+			v3 = hash_round64(v3, hash_read64(data + 16));
+			v4 = hash_round64(v4, hash_read64(data + 24));
+			data += 32;
+		} while (data + 32 <= end);
+
+		hash = hash_rotl64(v1, 1) + hash_rotl64(v2, 7) + hash_rotl64(v3, 12) + hash_rotl64(v4, 18);
+		hash = (hash ^ hash_round64(0, v1)) * HASH_PRIME64_1 + HASH_PRIME64_4;
+		hash = (hash ^ hash_round64(0, v2)) * HASH_PRIME64_1 + HASH_PRIME64_4;
+		hash = (hash ^ hash_round64(0, v3)) * HASH_PRIME64_1 + HASH_PRIME64_4;
+		hash = (hash ^ hash_round64(0, v4)) * HASH_PRIME64_1 + HASH_PRIME64_4;
+	} else
+		hash = HASH_PRIME64_5;
+
+	hash += length;
+
+	for (; data + 8 <= end; data += 8) {
+		hash ^= hash_round64(0, hash_read64(data));
+		hash = hash_rotl64(hash, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+	}
+	if (data + 4 <= end) {
+		hash ^= hash_read32(data) * HASH_PRIME64_1;
+		hash = hash_rotl64(hash, 23) * HASH_PRIME64_2 + HASH_PRIME64_3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		hash ^= *data * HASH_PRIME64_5;
+		hash = hash_rotl64(hash, 11) * HASH_PRIME64_1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= HASH_PRIME64_3;
+	hash ^= hash >> 32;
 	return hash;
 }
 
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "math.h"
+
+// Load generator for the generator server. Every connection runs on its own
+// thread and sends its requests one after the other, timing each of them.
+
+// Maximum number of connections
+#define LOADGEN_MAX_CONNECTIONS 1024
+
+// Settings shared by all connections
+static const char *loadgen_socket;
+static int loadgen_requests = 1000;
+static int loadgen_sentences = 1;
+static bool loadgen_seeded;
+
+// State of a connection
+struct loadgen_connection_t {
+	pthread_t thread;
+	int index;
+	double *latencies;
+	int64_t bytes;
+};
+
+// Connect to the server
+static inline int loadgen_connect(void)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, loadgen_socket, sizeof(address.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+		printf("Error connecting to %s: %s\n", loadgen_socket, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+// Read exactly the given number of bytes from the server
+static inline void loadgen_read(int fd, char *data, size_t length)
+{
+	while (length) {
+		ssize_t received = read(fd, data, length);
+		if (received == -1 && errno == EINTR)
+			continue;
+		if (received <= 0) {
+			printf("Connection closed by server\n");
+			exit(1);
+		}
+		data += received;
+		length -= received;
+	}
+}
+
+// Read a response from the server, and return the length of its text
+static inline size_t loadgen_response(int fd, char **text, size_t *text_size)
+{
+	// Read the length line one byte at a time, so that nothing of the text is
+	// consumed
+	char header[32];
+	int length = 0;
+	do {
+		if (length == sizeof(header) - 1) {
+			printf("Invalid response from server\n");
+			exit(1);
+		}
+		loadgen_read(fd, header + length, 1);
+	} while (header[length++] != '\n');
+	header[length] = '\0';
+	if (!strncmp(header, "ERR", 3)) {
+		printf("Server error: %s", header);
+		exit(1);
+	}
+
+	size_t text_length = strtoull(header, NULL, 10);
+	if (text_length > *text_size) {
+		*text_size = text_length;
+		*text = realloc(*text, *text_size);
+	}
+	loadgen_read(fd, *text, text_length);
+	return text_length;
+}
+
+// Connection thread, sends all the requests of a connection
+static void *loadgen_worker(void *arg)
+{
+	struct loadgen_connection_t *connection = arg;
+	int fd = loadgen_connect();
+	char *text = NULL;
+	size_t text_size = 0;
+
+	int i;
+	for (i = 0; i < loadgen_requests; i++) {
+		char request[64];
+		int length;
+		if (loadgen_seeded)
+			length = snprintf(request, sizeof(request), "%d %d\n", loadgen_sentences, connection->index * loadgen_requests + i);
+		else
+			length = snprintf(request, sizeof(request), "%d\n", loadgen_sentences);
+
+		double start = get_time();
+		if (write(fd, request, length) != length) {
+			printf("Error sending request: %s\n", strerror(errno));
+			exit(1);
+		}
+		connection->bytes += loadgen_response(fd, &text, &text_size);
+		connection->latencies[i] = get_time() - start;
+	}
+
+	free(text);
+	close(fd);
+	return NULL;
+}
+
+// Compare two latencies for sorting
+static int loadgen_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Main function
+int main(int argc, char **argv)
+{
+	int num_connections = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:N:rS:")) != -1) {
+		switch (opt) {
+		case 'c':
+			num_connections = atoi(optarg);
+			if (num_connections < 1 || num_connections > LOADGEN_MAX_CONNECTIONS) {
+				printf("Number of connections must be between 1 and %d\n", LOADGEN_MAX_CONNECTIONS);
+				return 1;
+			}
+			break;
+		case 'n':
+			loadgen_requests = atoi(optarg);
+			break;
+		case 'N':
+			loadgen_sentences = atoi(optarg);
+			break;
+		case 'r':
+			loadgen_seeded = true;
+			break;
+		case 'S':
+			loadgen_socket = optarg;
+			break;
+		default:
+			printf("Usage: %s -S socket [-c connections] [-n requests] [-N sentences] [-r]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!loadgen_socket || loadgen_requests < 1 || loadgen_sentences < 1) {
+		printf("Usage: %s -S socket [-c connections] [-n requests] [-N sentences] [-r]\n", argv[0]);
+		return 1;
+	}
+
+	// Run all the connections
+	static struct loadgen_connection_t connections[LOADGEN_MAX_CONNECTIONS];
+	double *latencies = malloc(sizeof(double) * num_connections * loadgen_requests);
+	if (!latencies) {
+		printf("Out of memory\n");
+		return 1;
+	}
+	double start = get_time();
+	int i;
+	for (i = 0; i < num_connections; i++) {
+		connections[i].index = i;
+		connections[i].latencies = latencies + (int64_t)i * loadgen_requests;
+		if (pthread_create(&connections[i].thread, NULL, loadgen_worker, &connections[i])) {
+			printf("Error creating connection thread\n");
+			return 1;
+		}
+	}
+	int64_t bytes = 0;
+	for (i = 0; i < num_connections; i++) {
+		pthread_join(connections[i].thread, NULL);
+		bytes += connections[i].bytes;
+	}
+	double elapsed = get_time() - start;
+
+	// Report the throughput and latency percentiles
+	int64_t num_requests = (int64_t)num_connections * loadgen_requests;
+	qsort(latencies, num_requests, sizeof(double), loadgen_compare);
+	printf("%lld requests of %d sentences over %d connections in %.3fs\n",
+	       (long long)num_requests, loadgen_sentences, num_connections, elapsed);
+	printf("%.0f requests/s, %.0f sentences/s, %.1f MB/s\n",
+	       num_requests / elapsed, num_requests * loadgen_sentences / elapsed, bytes / elapsed / 1e6);
+	printf("Latency: p50 %.1fus, p99 %.1fus, max %.1fus\n",
+	       latencies[num_requests / 2] * 1e6, latencies[num_requests * 99 / 100] * 1e6, latencies[num_requests - 1] * 1e6);
+
+	free(latencies);
+	return 0;
+}
@@ -4,120 +4,491 @@
 #include <signal.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include "hash.h"
 #include "math.h"
 #include "mempool.h"
 #include "stringpool.h"
 #include "markov.h"
+#include "mmapfile.h"
+#include "model.h"
+#include "scan.h"
+#include "table.h"
+#include "trace.h"
+#include "wiki.h"
 
-// Size of the markov chain node hash table
-#define MARKOV_TABLE_SIZE 0x1000000
+// Number of shards in the markov chain node hash table, and the initial size of
+// each shard. Shards grow independently once they become too full.
+#define MARKOV_SHARD_BITS 8
+#define MARKOV_SHARDS (1 << MARKOV_SHARD_BITS)
+#define MARKOV_SHARD_INITIAL_SIZE 0x40
 
-// Size of start node hash table
-#define MARKOV_START_SIZE 0x200000
+// Number of slots of the old table of a growing shard moved to the new table on
+// each lookup. Lookups which miss search both tables until the move is done, so
+// it is done in fairly large steps.
+#define MARKOV_REHASH_STEP 64
+
+// Maximum number of training threads
+#define MARKOV_MAX_THREADS 256
+
+// Number of bytes of input to accumulate before handing a batch to a worker
+#define MARKOV_BATCH_SIZE 0x100000
+
+// Number of bytes of input read at once
+#define MARKOV_READ_SIZE 0x100000
+
+// Number of batches that can be queued for the training threads
+#define MARKOV_QUEUE_SIZE 16
+
+// Size of the buffer of each thread writing the databases
+#define MARKOV_EXPORT_BUFFER_SIZE 0x400000
+
+// Memory for n-gram records shared by the training threads when training out
+// of core, unless a memory budget is given
+#define MARKOV_SPILL_DEFAULT_BUDGET 0x10000000
+
+// Number of buckets of the probe length histogram. Bucket i counts lookups
+// with a probe length from 2^i to 2^(i+1)-1, and the last bucket counts all
+// longer ones.
+#define MARKOV_PROBE_BUCKETS 8
+
+// Maximum number of runs merged at once, and the size of the read buffer of
+// each of them
+#define MARKOV_MERGE_WAYS 64
+#define MARKOV_MERGE_BUFFER_SIZE 0x40000
+
+// Values of the next string of an n-gram record marking the node as a start
+// state, or only recording that the node exists. They sort after all exits.
+#define MARKOV_GRAM_START UINT32_MAX
+#define MARKOV_GRAM_NODE (UINT32_MAX - 1)
 
 // An exit for a node in a markov chain
 struct markov_node_t;
 struct markov_exit_t {
 	struct markov_node_t *node;
-	int count;
+	int64_t count;
 };
 
 // An entry in an exit hash table
 struct markov_hash_exit_t {
 	struct markov_hash_exit_t *next;
 	struct markov_node_t *node;
-	int count;
+	int64_t count;
+};
+
+// An entry in the start table. It has the same size as an entry in an exit
+// hash table, and is allocated from the same pool.
+struct markov_start_t {
+	struct table_entry_t entry;
+	struct markov_node_t *node;
+	int64_t count;
 };
 
 // A node in a markov chain
 struct markov_node_t {
-	struct markov_node_t *next;
 	union {
-		const char *strings[MARKOV_ORDER];
+		string_id_t strings[MARKOV_ORDER];
 		markov_offset_t offset;
 	};
 	int num_exits;
+	unsigned int hash;
 	union {
 		struct markov_exit_t *exits;
 		struct markov_hash_exit_t **hashtable;
 	};
 };
 
+// A slot in the node hash table. The hash and string ids of the node are kept
+// inline so that most lookups only touch a single cache line. A NULL node marks
+// an empty slot.
+struct markov_slot_t {
+	unsigned int hash;
+	string_id_t strings[MARKOV_ORDER];
+	struct markov_node_t *node;
+};
+
+// A shard of the node hash table. Each shard is an open-addressing table using
+// robin hood hashing, and is protected by its own lock. The top bits of the
+// hash select the shard and the low bits select the home slot in the shard.
+//
+// A shard which gets too full switches to a table twice as big, and the lookups
+// which follow move the slots of the old table over a few at a time. Until then
+// the old table is only read, and nodes which are not found in either table are
+// added to the new one. The slots before rehash_index have been moved.
+struct markov_shard_t {
+	pthread_mutex_t lock;
+	struct markov_slot_t *slots;
+	unsigned int mask;
+	int count;
+	struct markov_slot_t *old_slots;
+	unsigned int old_mask;
+	unsigned int rehash_index;
+
+	// Offset of the first node of the shard in the node section, set
+	// during export
+	markov_offset_t offset;
+};
+
+// Memory pools used by a training thread. Every thread has its own set so that
+// allocation never needs a lock. Memory may be freed into a different thread's
+// pool than the one it came from, so only the sum of the counts is meaningful.
+struct markov_pools_t {
+	// Memory pool for hash exit nodes
+	struct mempool_t hashexitpool;
+
+	// Memory pool for the node structure
+	struct mempool_t nodepool;
+
+	// Memory pools for exits with 1 to 16 elements
+	struct mempool_t exitpool_small[16];
+
+	// Memory pools for exits with 32, 64 and 128 elements
+	struct mempool_t exitpool_32;
+	struct mempool_t exitpool_64;
+	struct mempool_t exitpool_128;
+
+	// Statistics for malloc()-based allocations
+	int64_t largepool_count;
+	int64_t largepool_total;
+
+	// Words and sentences trained on by the thread, and its node lookups by
+	// probe length
+	int64_t num_tokens;
+	int64_t num_sentences;
+	int64_t probes[MARKOV_PROBE_BUCKETS];
+};
+
+// An n-gram record of out-of-core training: the node with the given strings
+// has an exit to the node ending with the next string, which is counted count
+// times. The next string may instead be MARKOV_GRAM_START or MARKOV_GRAM_NODE.
+// Counts too large for a record are split over several equal records in a row.
+struct markov_gram_t {
+	string_id_t strings[MARKOV_ORDER];
+	string_id_t next;
+	uint32_t count;
+};
+
+// A sorted run of n-gram records being read during a merge
+struct markov_run_t {
+	FILE *file;
+	struct markov_gram_t gram;
+};
+
+// An entry of the node index written while laying out an out-of-core model,
+// giving the offset of each node in the node section
+struct markov_index_t {
+	string_id_t strings[MARKOV_ORDER];
+	markov_offset_t offset;
+};
+
+// A batch of input for a training thread. Words are stored as consecutive
+// null-terminated strings, and an empty string marks the end of a sentence.
+// Once interned, the words are replaced by their ids, with an id of 0 at the
+// end of each sentence.
+struct markov_batch_t {
+	char *text;
+	int length;
+	int size;
+	string_id_t *ids;
+	int num_ids;
+	int ids_size;
+};
+
 // Hash table of markov chain nodes
-static struct markov_node_t *markov_table[MARKOV_TABLE_SIZE];
+static struct markov_shard_t markov_table[MARKOV_SHARDS];
 
 // Hash table of start nodes
-static struct markov_hash_exit_t *markov_start_table[MARKOV_START_SIZE];
-static int markov_num_start;
+static struct table_t markov_start_table;
+static int64_t markov_num_start;
+
+// Memory pools for each training thread, and the pools of the current thread
+static struct markov_pools_t markov_pools[MARKOV_MAX_THREADS];
+static __thread struct markov_pools_t *markov_local;
+
+// Queue of batches waiting to be processed by the training threads. Batches
+// which have been processed are put back in the free list for reuse.
+static struct markov_batch_t *markov_queue[MARKOV_QUEUE_SIZE];
+static int markov_queue_head;
+static int markov_queue_count;
+static int markov_queue_busy;
+static bool markov_queue_done;
+static struct markov_batch_t *markov_free_batches[MARKOV_QUEUE_SIZE + MARKOV_MAX_THREADS + 1];
+static int markov_num_free_batches;
+static pthread_mutex_t markov_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markov_queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Number of training threads
+static int markov_num_threads = 1;
+
+// Whether to write alias tables when exporting
+static bool markov_export_alias;
 
-// Memory pool for hash exit nodes
-static struct mempool_t markov_hashexitpool;
+// Memory budget for the model in bytes, or 0 for no limit. When the model
+// grows past the budget, exits with a count of at most the prune threshold are
+// dropped, along with nodes which are no longer used. The threshold only goes
+// up, in the style of lossy counting, so that the count of an exit is never
+// underestimated by more than the sum of all thresholds used.
+static int64_t markov_memory_budget;
+static int markov_prune_threshold;
+static int64_t markov_prune_error;
 
-// Memory pool for the node structure
-static struct mempool_t markov_nodepool;
+// Totals of what has been pruned so far
+static int64_t markov_pruned_exits;
+static int64_t markov_pruned_count;
+static int64_t markov_pruned_nodes;
+static int64_t markov_pruned_starts;
 
-// Memory pools for exits with 1 to 16 elements
-static struct mempool_t markov_exitpool_small[16];
+// Total count of the exits and start states of the model training continued
+// from
+static int64_t markov_loaded_count;
 
-// Memory pools for exits with 32, 64 and 128 elements
-static struct mempool_t markov_exitpool_32;
-static struct mempool_t markov_exitpool_64;
-static struct mempool_t markov_exitpool_128;
+// Interval between reports of the training metrics in seconds, or 0 to only
+// report them on SIGUSR1
+static int markov_metrics_interval;
 
-// Statistics for malloc()-based allocations
-static int markov_largepool_count;
-static int markov_largepool_total;
+// Directory for the sorted runs of out-of-core training, or NULL when training
+// in memory. Each training thread collects n-gram records in its own buffer,
+// holding up to markov_spill_capacity records, and writes them out as a
+// sorted run when it is full.
+static const char *markov_spill_dir;
+static int64_t markov_spill_capacity;
+static int markov_num_runs;
+static __thread struct markov_gram_t *markov_grams;
+static __thread int64_t markov_num_grams;
 
-// Search the hash table for a node
-static inline struct markov_node_t *markov_find_node(int hash, const char *const *strings)
+// Input being read by the main thread: the batch being filled, the number of
+// words of the current sentence, the number of lines read and the phase being
+// traced
+static struct markov_batch_t *markov_input_batch;
+static int markov_input_length;
+static int markov_input_lines;
+static struct trace_span_t markov_input_span;
+
+// Scratch buffers used during export, one set per export thread
+static __thread struct markov_exit_t *markov_scratch;
+static __thread struct markov_export_wide_exit_t *markov_scratch_export;
+static __thread struct markov_export_exit_t *markov_scratch_narrow;
+static __thread struct markov_export_alias_t *markov_scratch_alias;
+static __thread unsigned __int128 *markov_scratch_weights;
+static __thread int *markov_scratch_worklist;
+static __thread int markov_scratch_size;
+
+// Buffered writer for a region of a database file. Writes go to the file with
+// pwrite at an explicit offset, so several threads can write disjoint parts of
+// the same file.
+struct markov_writer_t {
+	int fd;
+	const char *name;
+	markov_offset_t offset;
+	size_t used;
+	char *buffer;
+};
+
+// State shared by the export threads: the header of the model being written,
+// the file it is written to, and the index of the next node table shard to be
+// written
+static struct markov_header_t markov_export_header;
+static const char *markov_export_file;
+static int markov_export_fd;
+static int markov_export_next_shard;
+
+// Hash the strings of a node
+static inline unsigned int markov_hash(const string_id_t *strings)
 {
-	struct markov_node_t *node;
-	for (node = markov_table[hash]; node; node = node->next) {
-		int i;
-		for (i = 0; i < MARKOV_ORDER; i++) {
-			if (node->strings[i] != strings[i])
-				break;
+	return hash_mix(hash_ids(MARKOV_ORDER, strings));
+}
+
+// Get the shard of the node table which holds a given hash
+static inline struct markov_shard_t *markov_get_shard(unsigned int hash)
+{
+	return &markov_table[hash >> (32 - MARKOV_SHARD_BITS)];
+}
+
+// Get the distance of a slot of a table from the home slot of its hash
+static inline unsigned int markov_slot_distance(const struct markov_slot_t *slots, unsigned int mask, unsigned int index)
+{
+	return (index - slots[index].hash) & mask;
+}
+
+// Get the distance of a slot of a shard from the home slot of its hash
+static inline unsigned int markov_probe_distance(struct markov_shard_t *shard, unsigned int index)
+{
+	return markov_slot_distance(shard->slots, shard->mask, index);
+}
+
+// Count a node lookup in the probe length histogram of the current thread
+static inline void markov_count_probe(unsigned int distance)
+{
+	int bucket = 31 - __builtin_clz(distance + 1);
+	markov_local->probes[min(bucket, MARKOV_PROBE_BUCKETS - 1)]++;
+}
+
+// Search a table of a shard for a node
+static inline struct markov_node_t *markov_find_node(const struct markov_slot_t *slots, unsigned int mask, unsigned int hash,
+                                                     const string_id_t *strings)
+{
+	unsigned int index = hash & mask;
+	unsigned int distance;
+	for (distance = 0;; distance++) {
+		const struct markov_slot_t *slot = &slots[index];
+
+		// Robin hood hashing keeps slots ordered by probe distance, so we
+		// can stop as soon as we see a slot closer to its home than we are.
+		if (!slot->node || markov_slot_distance(slots, mask, index) < distance) {
+			markov_count_probe(distance);
+			return NULL;
+		}
+
+		if (slot->hash == hash) {
+			int i;
+			for (i = 0; i < MARKOV_ORDER; i++) {
+				if (slot->strings[i] != strings[i])
+					break;
+			}
+
+			if (i == MARKOV_ORDER) {
+				markov_count_probe(distance);
+				return slot->node;
+			}
 		}
 
-		if (i == MARKOV_ORDER)
-			return node;
+		index = (index + 1) & mask;
 	}
+}
 
-	return NULL;
+// Insert a slot into a shard. The slot must not already be in the table.
+static inline void markov_insert_slot(struct markov_shard_t *shard, struct markov_slot_t slot)
+{
+	unsigned int index = slot.hash & shard->mask;
+	unsigned int distance = 0;
+	while (shard->slots[index].node) {
+		// Take the place of any slot which is closer to its home than we are,
+		// and carry on inserting the displaced slot instead.
+		unsigned int existing = markov_probe_distance(shard, index);
+		if (existing < distance) {
+			struct markov_slot_t tmp = shard->slots[index];
+			shard->slots[index] = slot;
+			slot = tmp;
+			distance = existing;
+		}
+
+		index = (index + 1) & shard->mask;
+		distance++;
+	}
+
+	shard->slots[index] = slot;
+}
+
+// Move up to a number of slots of the old table of a growing shard to its new
+// table, and free the old table once they have all been moved
+static inline void markov_rehash_shard(struct markov_shard_t *shard, unsigned int steps)
+{
+	while (steps-- && shard->rehash_index <= shard->old_mask) {
+		struct markov_slot_t *slot = &shard->old_slots[shard->rehash_index++];
+		if (slot->node)
+			markov_insert_slot(shard, *slot);
+	}
+
+	if (shard->rehash_index > shard->old_mask) {
+		arena_free(shard->old_slots, (size_t)(shard->old_mask + 1) * sizeof(struct markov_slot_t));
+		shard->old_slots = NULL;
+	}
+}
+
+// Double the size of a shard. Its slots are moved to the new table by the
+// lookups which follow.
+static inline void markov_grow_shard(struct markov_shard_t *shard)
+{
+	// Finish moving the slots of the previous growth, which only happens if
+	// there were too few lookups since
+	if (shard->old_slots)
+		markov_rehash_shard(shard, shard->old_mask + 1);
+
+	shard->old_slots = shard->slots;
+	shard->old_mask = shard->mask;
+	shard->rehash_index = 0;
+	shard->slots = arena_calloc((size_t)(shard->mask + 1) * 2 * sizeof(struct markov_slot_t));
+	shard->mask = shard->mask * 2 + 1;
+}
+
+// Finish growing all the hash tables, so that their entries can be iterated
+// over. Must only be called while no training thread is running.
+static inline void markov_finish_rehash(void)
+{
+	table_finish(&string_table);
+	table_finish(&markov_start_table);
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		struct markov_shard_t *shard = &markov_table[i];
+		if (shard->old_slots)
+			markov_rehash_shard(shard, shard->old_mask + 1);
+	}
+}
+
+// Prefetch the home slot of a node. This is done without taking the lock: if
+// the shard is resized concurrently the prefetch is merely wasted.
+static inline void markov_prefetch_node(const string_id_t *strings)
+{
+	unsigned int hash = markov_hash(strings);
+	struct markov_shard_t *shard = markov_get_shard(hash);
+	__builtin_prefetch(&shard->slots[hash & shard->mask]);
 }
 
 // Search the hash table for a node. Allocates a new node if one wasn't found.
-// All strings should have been allocated using string_copy().
-static inline struct markov_node_t *markov_get_node(const char *const *strings)
+// All string ids should have been obtained from string_copy().
+static inline struct markov_node_t *markov_get_node(const string_id_t *strings)
 {
-	int hash = hash_strings(MARKOV_ORDER, strings) & (MARKOV_TABLE_SIZE - 1);
+	unsigned int hash = markov_hash(strings);
+	struct markov_shard_t *shard = markov_get_shard(hash);
 
-	struct markov_node_t *node = markov_find_node(hash, strings);
-	if (node)
+	pthread_mutex_lock(&shard->lock);
+	struct markov_node_t *node = markov_find_node(shard->slots, shard->mask, hash, strings);
+
+	// Nodes which haven't been moved yet are still in the old table
+	if (shard->old_slots) {
+		if (!node)
+			node = markov_find_node(shard->old_slots, shard->old_mask, hash, strings);
+		markov_rehash_shard(shard, MARKOV_REHASH_STEP);
+	}
+	if (node) {
+		pthread_mutex_unlock(&shard->lock);
 		return node;
+	}
+
+	// Keep the load factor of the shard below 3/4
+	if ((shard->count + 1) * 4ll > (shard->mask + 1) * 3ll)
+		markov_grow_shard(shard);
 
 	// Allocate a new node
-	node = mempool_alloc(&markov_nodepool, sizeof(struct markov_node_t));
+	node = mempool_alloc(&markov_local->nodepool, sizeof(struct markov_node_t));
 	node->num_exits = 0;
 	node->exits = NULL;
+	node->hash = hash;
+	struct markov_slot_t slot;
+	slot.hash = hash;
+	slot.node = node;
 	int i;
 	for (i = 0; i < MARKOV_ORDER; i++)
-		node->strings[i] = strings[i];
-	node->next = markov_table[hash];
-	markov_table[hash] = node;
+		slot.strings[i] = node->strings[i] = strings[i];
+	markov_insert_slot(shard, slot);
+	shard->count++;
+	pthread_mutex_unlock(&shard->lock);
 	return node;
 }
 
-// Search the node for the given exit and increments it if found. Returns false if not found.
-static inline bool markov_increment_exit(struct markov_node_t *node, struct markov_node_t *exit)
+// Search the node for the given exit and adds count to it if found. Returns false if not found.
+static inline bool markov_increment_exit(struct markov_node_t *node, struct markov_node_t *exit, int64_t count)
 {
 	if (node->num_exits > 128) {
 		int hash = hash_pointer(exit) & (next_power_of_2(node->num_exits) - 1);
 		struct markov_hash_exit_t *current;
 		for (current = node->hashtable[hash]; current; current = current->next) {
 			if (current->node == exit) {
-				current->count++;
+				current->count += count;
 				return true;
 			}
 		}
@@ -125,7 +496,7 @@ static inline bool markov_increment_exit(struct markov_node_t *node, struct mark
 		int i;
 		for (i = 0; i < node->num_exits; i++) {
 			if (node->exits[i].node == exit) {
-				node->exits[i].count++;
+				node->exits[i].count += count;
 				return true;
 			}
 		}
@@ -134,40 +505,41 @@ static inline bool markov_increment_exit(struct markov_node_t *node, struct mark
 	return false;
 }
 
-// Add an exit to a node
-static inline void markov_add_exit(struct markov_node_t *node, struct markov_node_t *exit)
+// Add an exit to a node, or add to its count if it already exists. The caller
+// must hold the lock of the node.
+static inline void markov_add_exit_locked(struct markov_node_t *node, struct markov_node_t *exit, int64_t count)
 {
 	// First see if we already have this exit
-	if (markov_increment_exit(node, exit))
+	if (markov_increment_exit(node, exit, count))
 		return;
 
 	// We need to add a new exit. See if we need to extend the exit list.
 	if (node->num_exits <= 16 || is_power_of_2(node->num_exits)) {
 		struct markov_exit_t *newexits;
 		if (node->num_exits == 0) {
-			newexits = mempool_alloc(&markov_exitpool_small[0], sizeof(struct markov_exit_t));
+			newexits = mempool_alloc(&markov_local->exitpool_small[0], sizeof(struct markov_exit_t));
 			node->exits = newexits;
 		} else if (node->num_exits < 16) {
-			struct mempool_t *oldpool = &markov_exitpool_small[node->num_exits - 1];
-			struct mempool_t *newpool = &markov_exitpool_small[node->num_exits];
+			struct mempool_t *oldpool = &markov_local->exitpool_small[node->num_exits - 1];
+			struct mempool_t *newpool = &markov_local->exitpool_small[node->num_exits];
 			newexits = mempool_alloc(newpool, sizeof(struct markov_exit_t) * (node->num_exits + 1));
 			memcpy(newexits, node->exits, sizeof(struct markov_exit_t) * node->num_exits);
 			mempool_free(oldpool, node->exits);
 			node->exits = newexits;
 		} else if (node->num_exits == 16) {
-			newexits = mempool_alloc(&markov_exitpool_32, sizeof(struct markov_exit_t) * 32);
+			newexits = mempool_alloc(&markov_local->exitpool_32, sizeof(struct markov_exit_t) * 32);
 			memcpy(newexits, node->exits, sizeof(struct markov_exit_t) * 16);
-			mempool_free(&markov_exitpool_small[15], node->exits);
+			mempool_free(&markov_local->exitpool_small[15], node->exits);
 			node->exits = newexits;
 		} else if (node->num_exits == 32) {
-			newexits = mempool_alloc(&markov_exitpool_64, sizeof(struct markov_exit_t) * 64);
+			newexits = mempool_alloc(&markov_local->exitpool_64, sizeof(struct markov_exit_t) * 64);
 			memcpy(newexits, node->exits, sizeof(struct markov_exit_t) * 32);
-			mempool_free(&markov_exitpool_32, node->exits);
+			mempool_free(&markov_local->exitpool_32, node->exits);
 			node->exits = newexits;
 		} else if (node->num_exits == 64) {
-			newexits = mempool_alloc(&markov_exitpool_128, sizeof(struct markov_exit_t) * 128);
+			newexits = mempool_alloc(&markov_local->exitpool_128, sizeof(struct markov_exit_t) * 128);
 			memcpy(newexits, node->exits, sizeof(struct markov_exit_t) * 64);
-			mempool_free(&markov_exitpool_64, node->exits);
+			mempool_free(&markov_local->exitpool_64, node->exits);
 			node->exits = newexits;
 		} else if (node->num_exits == 128) {
 			newexits = node->exits;
@@ -175,16 +547,16 @@ static inline void markov_add_exit(struct markov_node_t *node, struct markov_nod
 			assert(node->hashtable);
 			int i;
 			for (i = 0; i < 128; i++) {
-				int hash = hash_pointer(newexits[i].node) & 127;
-				struct markov_hash_exit_t *current = mempool_alloc(&markov_hashexitpool, sizeof(struct markov_hash_exit_t));
+				int hash = hash_pointer(newexits[i].node) & 255;
+				struct markov_hash_exit_t *current = mempool_alloc(&markov_local->hashexitpool, sizeof(struct markov_hash_exit_t));
 				current->node = newexits[i].node;
 				current->count = newexits[i].count;
 				current->next = node->hashtable[hash];
 				node->hashtable[hash] = current;
 			}
-			mempool_free(&markov_exitpool_128, newexits);
-			markov_largepool_count++;
-			markov_largepool_total += 256;
+			mempool_free(&markov_local->exitpool_128, newexits);
+			markov_local->largepool_count++;
+			markov_local->largepool_total += 256;
 		} else {
 			node->hashtable = realloc(node->hashtable, sizeof(struct markov_hash_exit_t *) * node->num_exits * 2);
 			memset(node->hashtable + node->num_exits, 0, sizeof(struct markov_hash_exit_t *) * node->num_exits);
@@ -206,50 +578,77 @@ static inline void markov_add_exit(struct markov_node_t *node, struct markov_nod
 					}
 				}
 			}
-			markov_largepool_total += node->num_exits + node->num_exits / 2;
+			markov_local->largepool_total += node->num_exits + node->num_exits / 2;
 		}
 	}
 
 	// Now finally add the exit
 	if (++node->num_exits > 128) {
 		int hash = hash_pointer(exit) & (next_power_of_2(node->num_exits) - 1);
-		struct markov_hash_exit_t *current = mempool_alloc(&markov_hashexitpool, sizeof(struct markov_hash_exit_t));
+		struct markov_hash_exit_t *current = mempool_alloc(&markov_local->hashexitpool, sizeof(struct markov_hash_exit_t));
 		current->node = exit;
-		current->count = 1;
+		current->count = count;
 		current->next = node->hashtable[hash];
 		node->hashtable[hash] = current;
 	} else {
 		node->exits[node->num_exits - 1].node = exit;
-		node->exits[node->num_exits - 1].count = 1;
+		node->exits[node->num_exits - 1].count = count;
 	}
 }
 
-// Add a node to the start of the chain
-static inline void markov_add_start(struct markov_node_t *node)
+// Add an exit to a node, or add to its count if it already exists
+static inline void markov_add_exit(struct markov_node_t *node, struct markov_node_t *exit, int64_t count)
+{
+	pthread_mutex_t *lock = &markov_get_shard(node->hash)->lock;
+	pthread_mutex_lock(lock);
+	markov_add_exit_locked(node, exit, count);
+	pthread_mutex_unlock(lock);
+}
+
+// Hash the node of a start state. The hash is mixed so that its top bits can
+// pick the shard of the table.
+static inline unsigned int markov_start_hash(const struct markov_node_t *node)
+{
+	return hash_mix(hash_pointer(node));
+}
+
+// Hash an entry of the start table
+static inline unsigned int markov_start_hash_entry(const struct table_entry_t *entry)
 {
-	int hash = hash_pointer(node) & (MARKOV_START_SIZE - 1);
+	return markov_start_hash(((const struct markov_start_t *)entry)->node);
+}
+
+// Add a node to the start of the chain, or add to its count if it is already
+// there
+static inline void markov_add_start(struct markov_node_t *node, int64_t count)
+{
+	unsigned int hash = markov_start_hash(node);
+	struct table_shard_t *shard = table_shard(&markov_start_table, hash);
 
 	// Search the hash table for the node
-	struct markov_hash_exit_t *start;
-	for (start = markov_start_table[hash]; start; start = start->next) {
+	struct markov_start_t *start;
+	pthread_mutex_lock(&shard->lock);
+	struct table_entry_t **bucket = table_bucket(&markov_start_table, shard, hash);
+	for (start = (struct markov_start_t *)*bucket; start; start = (struct markov_start_t *)start->entry.next) {
 		if (start->node == node) {
-			start->count++;
+			start->count += count;
+			pthread_mutex_unlock(&shard->lock);
 			return;
 		}
 	}
 
 	// Allocate a new entry and add it to the hash table
-	start = mempool_alloc(&markov_hashexitpool, sizeof(struct markov_hash_exit_t));
-	start->count = 1;
+	start = mempool_alloc(&markov_local->hashexitpool, sizeof(struct markov_start_t));
+	start->count = count;
 	start->node = node;
-	start->next = markov_start_table[hash];
-	markov_start_table[hash] = start;
-	markov_num_start++;
+	table_insert(&markov_start_table, shard, bucket, &start->entry);
+	pthread_mutex_unlock(&shard->lock);
+	__sync_fetch_and_add(&markov_num_start, 1);
 }
 
-// Train the markov model using the given sentence. All strings in the sentence
-// must have been allocated using string_copy().
-static inline void markov_train(int length, const char *const *sentence)
+// Train the markov model using the given sentence. All string ids in the
+// sentence must have been obtained from string_copy().
+static inline void markov_train(int length, const string_id_t *sentence)
 {
 	// Ignore empty sentences
 	if (!length)
@@ -257,371 +656,2151 @@ static inline void markov_train(int length, const char *const *sentence)
 
 	// Handle sentences shorter than MARKOV_ORDER
 	if (length < MARKOV_ORDER) {
-		const char *buffer[MARKOV_ORDER];
+		string_id_t buffer[MARKOV_ORDER];
 		int i;
 		for (i = 0; i < length; i++)
 			buffer[i] = sentence[i];
 		for (i = length; i < MARKOV_ORDER; i++)
-			buffer[i] = NULL;
-		markov_add_start(markov_get_node(buffer));
+			buffer[i] = 0;
+		markov_add_start(markov_get_node(buffer), 1);
 		return;
 	}
 
 	// Build first node
 	struct markov_node_t *node = markov_get_node(sentence);
-	markov_add_start(node);
+	markov_add_start(node, 1);
 
 	// Build middle nodes
 	int i;
 	for (i = MARKOV_ORDER; i < length; i++) {
 		sentence++;
+		// Start loading the slot of the next node while we deal with this one
+		if (i + 1 < length)
+			markov_prefetch_node(sentence + 1);
 		struct markov_node_t *nextnode = markov_get_node(sentence);
-		markov_add_exit(node, nextnode);
+		markov_add_exit(node, nextnode, 1);
 		node = nextnode;
 	}
 
 	// Build last node
 	sentence++;
-	const char *buffer[MARKOV_ORDER];
+	string_id_t buffer[MARKOV_ORDER];
 	for (i = 0; i < MARKOV_ORDER - 1; i++)
 		buffer[i] = sentence[i];
-	buffer[MARKOV_ORDER - 1] = NULL;
+	buffer[MARKOV_ORDER - 1] = 0;
 	struct markov_node_t *nextnode = markov_get_node(buffer);
-	markov_add_exit(node, nextnode);
+	markov_add_exit(node, nextnode, 1);
 }
 
 // Initialize various stuff
 static inline void markov_init(void)
 {
 	string_init();
+	table_init(&markov_start_table, markov_start_hash_entry);
+
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		struct markov_shard_t *shard = &markov_table[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->slots = arena_calloc(MARKOV_SHARD_INITIAL_SIZE * sizeof(struct markov_slot_t));
+		shard->mask = MARKOV_SHARD_INITIAL_SIZE - 1;
+	}
+
+	// The main thread uses the first set of pools
+	markov_local = &markov_pools[0];
 }
 
 // Print the entire model
 static inline void markov_print(void)
 {
+	markov_finish_rehash();
+
 	// Print all start nodes
 	printf("START\n");
-	int i;
-	for (i = 0; i < MARKOV_START_SIZE; i++) {
-		struct markov_hash_exit_t *current;
-		for (current = markov_start_table[i]; current; current = current->next) {
-			printf("  %d ->", current->count);
-			int j;
-			for (j = 0; j < MARKOV_ORDER; j++)
-				printf(" %s", current->node->strings[j]);
-			printf("\n");
-		}
+	struct table_iter_t iter;
+	struct markov_start_t *start;
+	table_iter_init(&iter, &markov_start_table);
+	while ((start = (struct markov_start_t *)table_iter_next(&iter))) {
+		printf("  %lld ->", (long long)start->count);
+		int j;
+		for (j = 0; j < MARKOV_ORDER; j++)
+			printf(" %s", string_get(start->node->strings[j]));
+		printf("\n");
 	}
 
 	// Print all the other nodes
-	for (i = 0; i < MARKOV_TABLE_SIZE; i++) {
-		struct markov_node_t *current;
-		for (current = markov_table[i]; current; current = current->next) {
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		unsigned int index;
+		for (index = 0; index <= markov_table[i].mask; index++) {
+			struct markov_node_t *current = markov_table[i].slots[index].node;
+			if (!current)
+				continue;
+
 			printf("NODE");
 			int j;
 			for (j = 0; j < MARKOV_ORDER; j++)
-				printf(" %s", current->strings[j]);
+				printf(" %s", string_get(current->strings[j]));
 			printf("\n");
 			for (j = 0; j < current->num_exits; j++) {
-				printf("  %d ->", current->exits[j].count);
+				printf("  %lld ->", (long long)current->exits[j].count);
 				int k;
 				for (k = 0; k < MARKOV_ORDER; k++)
-					printf(" %s", current->exits[j].node->strings[k]);
+					printf(" %s", string_get(current->exits[j].node->strings[k]));
 				printf("\n");
 			}
 		}
 	}
 }
 
-// Get some stats on the various hash tables
-static void markov_stats(void)
+// Add up the pool statistics of all training threads
+static inline void markov_sum_pools(struct markov_pools_t *total)
 {
-	int max_depth;
-	int total_depth;
-	int num_filled;
-	int count;
+	memset(total, 0, sizeof(struct markov_pools_t));
 	int i;
-
-	// String table
-	max_depth = total_depth = num_filled = count = 0;
-	for (i = 0; i < STRING_TABLE_SIZE; i++) {
-		if (string_pool[i])
-			num_filled++;
-
-		int depth = 0;
-		struct string_pool_t *current;
-		for (current = string_pool[i]; current; current = current->next) {
-			count++;
-			depth++;
-		}
-
-		total_depth += depth * depth;
-		max_depth = max(depth, max_depth);
+	for (i = 0; i < markov_num_threads; i++) {
+		struct markov_pools_t *pools = &markov_pools[i];
+		total->hashexitpool.count += pools->hashexitpool.count;
+		total->nodepool.count += pools->nodepool.count;
+		int j;
+		for (j = 0; j < 16; j++)
+			total->exitpool_small[j].count += pools->exitpool_small[j].count;
+		total->exitpool_32.count += pools->exitpool_32.count;
+		total->exitpool_64.count += pools->exitpool_64.count;
+		total->exitpool_128.count += pools->exitpool_128.count;
+		total->largepool_count += pools->largepool_count;
+		total->largepool_total += pools->largepool_total;
+		total->num_tokens += pools->num_tokens;
+		total->num_sentences += pools->num_sentences;
+		for (j = 0; j < MARKOV_PROBE_BUCKETS; j++)
+			total->probes[j] += pools->probes[j];
 	}
-	printf("\nString table\n");
-	printf("%d elements, %d/%d slots, load factor %f\n", count, num_filled, STRING_TABLE_SIZE, (float)count / STRING_TABLE_SIZE);
-	printf("%d empty slots, %f usage \n", STRING_TABLE_SIZE - num_filled, (float)num_filled / STRING_TABLE_SIZE);
-	printf("Max depth %d, average depth %f\n", max_depth, (float)total_depth / count);
-	printf("Memory used by hash table structure: %zdk\n\n", STRING_TABLE_SIZE * sizeof(struct string_pool_t *) / 1024);
+}
 
-	// Start table
-	max_depth = total_depth = num_filled = count = 0;
-	for (i = 0; i < MARKOV_START_SIZE; i++) {
-		if (markov_start_table[i])
-			num_filled++;
+// Print some stats on a chained hash table. The buckets of a growing shard
+// which have not been moved yet are counted in the old array.
+static void markov_table_stats(const char *name, struct table_t *table)
+{
+	int max_depth = 0;
+	int64_t total_depth = 0;
+	int64_t num_filled = 0;
+	int64_t num_buckets = 0;
+	int64_t count = 0;
+	int i;
+	for (i = 0; i < TABLE_SHARDS; i++) {
+		struct table_shard_t *shard = &table->shards[i];
+		int old;
+		for (old = 0; old < 2; old++) {
+			struct table_entry_t **buckets = old ? shard->old_buckets : shard->buckets;
+			if (!buckets)
+				continue;
+			unsigned int mask = old ? shard->old_mask : shard->mask;
+			unsigned int index;
+			for (index = old ? shard->rehash_index : 0; index <= mask; index++) {
+				if (buckets[index])
+					num_filled++;
 
-		int depth = 0;
-		struct markov_hash_exit_t *current;
-		for (current = markov_start_table[i]; current; current = current->next) {
-			count++;
-			depth++;
-		}
+				int depth = 0;
+				struct table_entry_t *current;
+				for (current = buckets[index]; current; current = current->next) {
+					count++;
+					depth++;
+				}
 
-		total_depth += depth * depth;
-		max_depth = max(depth, max_depth);
+				total_depth += depth * depth;
+				max_depth = max(depth, max_depth);
+			}
+		}
+		num_buckets += shard->mask + 1;
 	}
-	printf("Start table\n");
-	printf("%d elements, %d/%d slots, load factor %f\n", count, num_filled, MARKOV_START_SIZE, (float)count / MARKOV_START_SIZE);
-	printf("%d empty slots, %f usage \n", MARKOV_START_SIZE - num_filled, (float)num_filled / MARKOV_START_SIZE);
+	printf("%s\n", name);
+	printf("%lld elements, %lld/%lld slots in %d shards, load factor %f\n", (long long)count, (long long)num_filled,
+	       (long long)num_buckets, TABLE_SHARDS, (float)count / num_buckets);
+	printf("%lld empty slots, %f usage \n", (long long)(num_buckets - num_filled), (float)num_filled / num_buckets);
 	printf("Max depth %d, average depth %f\n", max_depth, (float)total_depth / count);
-	printf("Memory used by hash table structure: %zdk\n\n", MARKOV_START_SIZE * sizeof(struct markov_hash_exit_t *) / 1024);
+	printf("Memory used by hash table structure: %lldk\n\n", (long long)(table_memory(table) / 1024));
+}
+
+// Get some stats on the various hash tables. This runs at exit, possibly while
+// training threads are still running, so the tables are only read and any
+// growing shards are left as they are.
+static void markov_stats(void)
+{
+	printf("\n");
+	markov_table_stats("String table", &string_table);
+	markov_table_stats("Start table", &markov_start_table);
 
 	// Node table
-	max_depth = total_depth = num_filled = count = 0;
-	for (i = 0; i < MARKOV_TABLE_SIZE; i++) {
-		if (markov_table[i])
-			num_filled++;
+	int max_probe = 0;
+	long long total_probe = 0;
+	int64_t num_slots = 0;
+	int64_t count = 0;
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		struct markov_shard_t *shard = &markov_table[i];
+		int old;
+		for (old = 0; old < 2; old++) {
+			struct markov_slot_t *slots = old ? shard->old_slots : shard->slots;
+			if (!slots)
+				continue;
+			unsigned int mask = old ? shard->old_mask : shard->mask;
+			unsigned int index;
+			for (index = old ? shard->rehash_index : 0; index <= mask; index++) {
+				if (!slots[index].node)
+					continue;
 
-		int depth = 0;
-		struct markov_node_t *current;
-		for (current = markov_table[i]; current; current = current->next) {
-			count++;
-			depth++;
+				int probe = markov_slot_distance(slots, mask, index) + 1;
+				count++;
+				total_probe += probe;
+				max_probe = max(probe, max_probe);
+			}
 		}
-
-		total_depth += depth * depth;
-		max_depth = max(depth, max_depth);
+		num_slots += shard->mask + 1;
 	}
 	printf("Node table\n");
-	printf("%d elements, %d/%d slots, load factor %f\n", count, num_filled, MARKOV_TABLE_SIZE, (float)count / MARKOV_TABLE_SIZE);
-	printf("%d empty slots, %f usage \n", MARKOV_TABLE_SIZE - num_filled, (float)num_filled / MARKOV_TABLE_SIZE);
-	printf("Max depth %d, average depth %f\n", max_depth, (float)total_depth / count);
-	printf("Memory used by hash table structure: %zdk\n\n", MARKOV_TABLE_SIZE * sizeof(struct markov_node_t *) / 1024);
+	printf("%lld elements, %lld slots in %d shards, load factor %f\n", (long long)count, (long long)num_slots, MARKOV_SHARDS, (float)count / num_slots);
+	printf("Max probe length %d, average probe length %f\n", max_probe, (float)total_probe / count);
+	printf("Memory used by hash table structure: %zdk\n\n", num_slots * sizeof(struct markov_slot_t) / 1024);
 
 	// Print the number of allocated elements in each pool
-	printf("Node pool: %d, %zdk mem usage\n", markov_nodepool.count, markov_nodepool.count * sizeof(struct markov_node_t) / 1024);
-	printf("Hash exit pool: %d, %zdk mem usage\n", markov_hashexitpool.count, markov_hashexitpool.count * sizeof(struct markov_hash_exit_t) / 1024);
+	struct markov_pools_t pools;
+	markov_sum_pools(&pools);
+	printf("Node pool: %lld, %lldk mem usage\n", (long long)pools.nodepool.count, (long long)(pools.nodepool.count * sizeof(struct markov_node_t) / 1024));
+	printf("Hash exit pool: %lld, %lldk mem usage\n", (long long)pools.hashexitpool.count, (long long)(pools.hashexitpool.count * sizeof(struct markov_hash_exit_t) / 1024));
 	for (i = 0; i < 16; i++)
-		printf("%d exits pool: %d, %zdk mem usage\n", i + 1, markov_exitpool_small[i].count, markov_exitpool_small[i].count * (i + 1) * sizeof(struct markov_exit_t) / 1024);
-	printf("32 exits pool: %d, %zdk mem usage\n", markov_exitpool_32.count, markov_exitpool_32.count * 32 * sizeof(struct markov_exit_t) / 1024);
-	printf("64 exits pool: %d, %zdk mem usage\n", markov_exitpool_64.count, markov_exitpool_64.count * 64 * sizeof(struct markov_exit_t) / 1024);
-	printf("128 exits pool: %d, %zdk mem usage\n", markov_exitpool_128.count, markov_exitpool_128.count * 128 * sizeof(struct markov_exit_t) / 1024);
-	printf("Larger nodes: %d, %zdk mem usage\n", markov_largepool_count, markov_largepool_total * sizeof(struct markov_exit_t) / 1024);
-	printf("String pool: %d strings, %dk mem usage\n", string_pool_count, string_mem_usage / 1024);
+		printf("%d exits pool: %lld, %lldk mem usage\n", i + 1, (long long)pools.exitpool_small[i].count, (long long)(pools.exitpool_small[i].count * (i + 1) * sizeof(struct markov_exit_t) / 1024));
+	printf("32 exits pool: %lld, %lldk mem usage\n", (long long)pools.exitpool_32.count, (long long)(pools.exitpool_32.count * 32 * sizeof(struct markov_exit_t) / 1024));
+	printf("64 exits pool: %lld, %lldk mem usage\n", (long long)pools.exitpool_64.count, (long long)(pools.exitpool_64.count * 64 * sizeof(struct markov_exit_t) / 1024));
+	printf("128 exits pool: %lld, %lldk mem usage\n", (long long)pools.exitpool_128.count, (long long)(pools.exitpool_128.count * 128 * sizeof(struct markov_exit_t) / 1024));
+	printf("Larger nodes: %lld, %lldk mem usage\n", (long long)pools.largepool_count, (long long)(pools.largepool_total * sizeof(struct markov_exit_t) / 1024));
+	printf("String pool: %u strings, %lldk mem usage\n", string_pool_count, (long long)(string_mem_usage / 1024));
 }
 
-// First pass: Write the nodes to the file and leave holes for the exits
-static inline void markov_export_nodes(FILE *file)
+// Write a block of data at an offset of a database file
+static inline void markov_pwrite(int fd, const char *name, const void *data, size_t size, markov_offset_t offset)
 {
-	int i;
-	for (i = 0; i < MARKOV_TABLE_SIZE; i++) {
-		struct markov_node_t *current;
-		for (current = markov_table[i]; current; current = current->next) {
-			// Create the node structure
-			struct markov_export_node_t export;
-			int j;
-			for (j = 0; j < MARKOV_ORDER; j++)
-				export.strings[j] = string_offset(current->strings[j]);
-			export.num_exits = current->num_exits;
+	const char *pos = data;
+	while (size) {
+		ssize_t written = pwrite64(fd, pos, size, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("Error writing to %s database: %s\n", name, strerror(errno));
+			exit(1);
+		}
+		pos += written;
+		size -= written;
+		offset += written;
+	}
+}
 
-			// Save the node offset for the second pass
-			current->offset = ftello64(file);
+// Start a writer at an offset of a database file
+static inline void markov_writer_init(struct markov_writer_t *writer, int fd, const char *name, markov_offset_t offset)
+{
+	writer->fd = fd;
+	writer->name = name;
+	writer->offset = offset;
+	writer->used = 0;
+	writer->buffer = malloc(MARKOV_EXPORT_BUFFER_SIZE);
+	assert(writer->buffer);
+}
 
-			// Write the node to the file
-			if (!fwrite(&export, sizeof(struct markov_export_node_t), 1, file)) {
-				printf("Error writing to markov database: %s\n", strerror(errno));
-				exit(1);
-			}
+// Write out the buffered data of a writer
+static inline void markov_writer_flush(struct markov_writer_t *writer)
+{
+	markov_pwrite(writer->fd, writer->name, writer->buffer, writer->used, writer->offset);
+	writer->offset += writer->used;
+	writer->used = 0;
+}
 
-			// Leave a hole in the file for putting the exits
-			fseeko64(file, sizeof(struct markov_export_exit_t) * current->num_exits, SEEK_CUR);
-		}
-	}
+// Write the buffered data of a writer and release its buffer
+static inline void markov_writer_close(struct markov_writer_t *writer)
+{
+	markov_writer_flush(writer);
+	free(writer->buffer);
 }
 
-// Second pass: Write the exits in the holes from the first pass
-static inline void markov_export_exits(FILE *file)
+// Append data to a writer. Blocks larger than the buffer bypass it.
+static inline void markov_writer_write(struct markov_writer_t *writer, const void *data, size_t size)
 {
-	int i;
-	for (i = 0; i < MARKOV_TABLE_SIZE; i++) {
-		struct markov_node_t *current;
-		for (current = markov_table[i]; current; current = current->next) {
-			// Go to the offset of the exits for this node
-			fseeko64(file, current->offset + sizeof(struct markov_export_node_t), SEEK_SET);
-
-			// Go through all the exits of this node
-			int total_count = 0;
-			if (current->num_exits > 128) {
-				int j;
-				int table_size = next_power_of_2(current->num_exits);
-				for (j = 0; j < table_size; j++) {
-					struct markov_hash_exit_t *current_exit;
-					for (current_exit = current->hashtable[j]; current_exit; current_exit = current_exit->next) {
-						total_count += current_exit->count;
-						struct markov_export_exit_t export;
-						export.node = current_exit->node->offset;
-						export.count = total_count;
-						if (!fwrite(&export, sizeof(struct markov_export_exit_t), 1, file)) {
-							printf("Error writing to markov database: %s\n", strerror(errno));
-							exit(1);
-						}
-					}
-				}
-			} else {
-				int j;
-				for (j = 0; j < current->num_exits; j++) {
-					total_count += current->exits[j].count;
-					struct markov_export_exit_t export;
-					export.node = current->exits[j].node->offset;
-					export.count = total_count;
-					if (!fwrite(&export, sizeof(struct markov_export_exit_t), 1, file)) {
-						printf("Error writing to markov database: %s\n", strerror(errno));
-						exit(1);
-					}
-				}
-			}
+	if (writer->used + size > MARKOV_EXPORT_BUFFER_SIZE) {
+		markov_writer_flush(writer);
+		if (size > MARKOV_EXPORT_BUFFER_SIZE) {
+			markov_pwrite(writer->fd, writer->name, data, size, writer->offset);
+			writer->offset += size;
+			return;
 		}
 	}
+
+	memcpy(writer->buffer + writer->used, data, size);
+	writer->used += size;
 }
 
-// Write all the start states
-static inline void markov_export_start(FILE *file)
+// Get the number of exits of a node as stored in the markov database, flagged
+// with MARKOV_EXITS_WIDE when the total count of the exits needs 64 bits
+static inline uint32_t markov_export_num_exits(int64_t num_exits, int64_t total_count)
 {
-	// Write the number of start states
-	if (!fwrite(&markov_num_start, sizeof(markov_num_start), 1, file)) {
-		printf("Error writing to start database: %s\n", strerror(errno));
+	if (num_exits >= MARKOV_EXITS_WIDE) {
+		printf("Too many exits to export: %lld\n", (long long)num_exits);
 		exit(1);
 	}
+	return total_count > UINT32_MAX ? num_exits | MARKOV_EXITS_WIDE : num_exits;
+}
+
+// Get the size of the exit list of a node in the markov database, given its
+// number of exits as stored in the database
+static inline markov_offset_t markov_exits_size(uint32_t num_exits)
+{
+	markov_offset_t size = markov_exit_size(num_exits);
+	if (markov_export_alias)
+		size += sizeof(struct markov_export_alias_t);
+	return size * (num_exits & ~MARKOV_EXITS_WIDE);
+}
+
+// Get a scratch buffer big enough to hold the given number of exits. The
+// buffer is reused between calls.
+static inline struct markov_exit_t *markov_get_scratch(int num_exits)
+{
+	if (num_exits > markov_scratch_size) {
+		markov_scratch_size = max(num_exits, markov_scratch_size * 2);
+		free(markov_scratch);
+		free(markov_scratch_export);
+		free(markov_scratch_narrow);
+		free(markov_scratch_alias);
+		free(markov_scratch_weights);
+		free(markov_scratch_worklist);
+		markov_scratch = malloc(sizeof(struct markov_exit_t) * markov_scratch_size);
+		markov_scratch_export = malloc(sizeof(struct markov_export_wide_exit_t) * markov_scratch_size);
+		markov_scratch_narrow = malloc(sizeof(struct markov_export_exit_t) * markov_scratch_size);
+		markov_scratch_alias = malloc(sizeof(struct markov_export_alias_t) * markov_scratch_size);
+		markov_scratch_weights = malloc(sizeof(unsigned __int128) * markov_scratch_size);
+		markov_scratch_worklist = malloc(sizeof(int) * markov_scratch_size);
+		assert(markov_scratch && markov_scratch_export && markov_scratch_narrow && markov_scratch_alias && markov_scratch_weights && markov_scratch_worklist);
+	}
+
+	return markov_scratch;
+}
+
+// Free the scratch buffers of the current thread
+static inline void markov_free_scratch(void)
+{
+	free(markov_scratch);
+	free(markov_scratch_export);
+	free(markov_scratch_narrow);
+	free(markov_scratch_alias);
+	free(markov_scratch_weights);
+	free(markov_scratch_worklist);
+	markov_scratch = NULL;
+	markov_scratch_export = NULL;
+	markov_scratch_narrow = NULL;
+	markov_scratch_alias = NULL;
+	markov_scratch_weights = NULL;
+	markov_scratch_worklist = NULL;
+	markov_scratch_size = 0;
+}
+
+// Get the exits of a node as a flat list, whichever way they are stored
+static inline struct markov_exit_t *markov_collect_exits(struct markov_node_t *node)
+{
+	if (node->num_exits <= 128)
+		return node->exits;
 
+	struct markov_exit_t *exits = markov_get_scratch(node->num_exits);
+	int num_exits = 0;
 	int i;
-	int total_count = 0;
-	for (i = 0; i < MARKOV_START_SIZE; i++) {
+	int table_size = next_power_of_2(node->num_exits);
+	for (i = 0; i < table_size; i++) {
 		struct markov_hash_exit_t *current;
-		for (current = markov_start_table[i]; current; current = current->next) {
-			total_count += current->count;
-			struct markov_export_exit_t export;
-			export.node = current->node->offset;
-			export.count = total_count;
-			if (!fwrite(&export, sizeof(struct markov_export_exit_t), 1, file)) {
-				printf("Error writing to start database: %s\n", strerror(errno));
-				exit(1);
-			}
+		for (current = node->hashtable[i]; current; current = current->next) {
+			exits[num_exits].node = current->node;
+			exits[num_exits].count = current->count;
+			num_exits++;
 		}
 	}
+
+	return exits;
 }
 
-// Export the markov model to a file
-static inline void markov_export(void)
+// Build an alias table for a list of exits using Vose's method. The weight of
+// each exit is scaled by the number of exits so that the average weight is the
+// total count. With 64-bit counts the scaled weights need more than 64 bits.
+static inline struct markov_export_alias_t *markov_build_alias(int num_exits, const struct markov_export_wide_exit_t *exits)
 {
-	// First create the string database
-	FILE *file = fopen("stringdb", "w");
-	if (!file) {
-		printf("Error opening string database for writing: %s\n", strerror(errno));
-		exit(1);
+	markov_get_scratch(num_exits);
+	struct markov_export_alias_t *alias = markov_scratch_alias;
+	unsigned __int128 *weights = markov_scratch_weights;
+	int *worklist = markov_scratch_worklist;
+
+	unsigned __int128 total = 0;
+	int i;
+	for (i = 0; i < num_exits; i++)
+		total += exits[i].count;
+
+	// Split the exits into those below the average weight, which are
+	// stacked at the start of the work list, and those above it, which are
+	// stacked at the end.
+	int num_small = 0;
+	int large = num_exits;
+	for (i = 0; i < num_exits; i++) {
+		weights[i] = (unsigned __int128)exits[i].count * num_exits;
+		if (weights[i] < total)
+			worklist[num_small++] = i;
+		else
+			worklist[--large] = i;
 	}
-	printf("Writing strings... ");
-	fflush(stdout);
-	string_export(file);
-	if (fclose(file)) {
-		printf("Error writing to string database: %s\n", strerror(errno));
-		exit(1);
+
+	// Fill up each small entry using part of a large entry. The probability
+	// is computed in integers, since in floating point a weight just below a
+	// large total could round up to 2^32.
+	while (num_small && large < num_exits) {
+		int small_index = worklist[--num_small];
+		int large_index = worklist[large];
+		alias[small_index].probability = min((weights[small_index] << 32) / total, UINT32_MAX);
+		alias[small_index].alias = large_index;
+		weights[large_index] -= total - weights[small_index];
+		if (weights[large_index] < total) {
+			large++;
+			worklist[num_small++] = large_index;
+		}
 	}
-	printf("done\n");
 
-	// Then create the node and exit database
-	file = fopen("markovdb", "w");
-	if (!file) {
-		printf("Error opening markov database for writing: %s\n", strerror(errno));
-		exit(1);
+	// Whatever is left over (only rounding errors) always picks itself
+	while (num_small) {
+		i = worklist[--num_small];
+		alias[i].probability = UINT32_MAX;
+		alias[i].alias = i;
 	}
-	printf("Writing markov nodes... ");
-	fflush(stdout);
-	markov_export_nodes(file);
-	printf("done\n");
-	printf("Writing markov exits... ");
-	fflush(stdout);
-	markov_export_exits(file);
-	if (fclose(file)) {
-		printf("Error writing to markov database: %s\n", strerror(errno));
-		exit(1);
+	for (; large < num_exits; large++) {
+		i = worklist[large];
+		alias[i].probability = UINT32_MAX;
+		alias[i].alias = i;
 	}
-	printf("done\n");
 
-	// Finally create the start states database
-	file = fopen("startdb", "w");
-	if (!file) {
-		printf("Error opening start database for writing: %s\n", strerror(errno));
-		exit(1);
+	return alias;
+}
+
+// Write the number of exits of a list of exits holding the count of each exit,
+// then the exits themselves. The counts are made cumulative in place, and only
+// take 64 bits in the file if the total count needs them. The exits are
+// followed by their alias table if alias tables are enabled. Returns the number
+// of exits as written.
+static inline uint32_t markov_write_export_exits(struct markov_writer_t *writer, int num_exits, struct markov_export_wide_exit_t *exits)
+{
+	struct markov_export_alias_t *alias = NULL;
+	if (markov_export_alias && num_exits)
+		alias = markov_build_alias(num_exits, exits);
+
+	int i;
+	for (i = 1; i < num_exits; i++)
+		exits[i].count += exits[i - 1].count;
+	uint32_t export_num_exits = markov_export_num_exits(num_exits, num_exits ? exits[num_exits - 1].count : 0);
+	markov_writer_write(writer, &export_num_exits, sizeof(export_num_exits));
+	if (export_num_exits & MARKOV_EXITS_WIDE)
+		markov_writer_write(writer, exits, sizeof(struct markov_export_wide_exit_t) * num_exits);
+	else {
+		markov_get_scratch(num_exits);
+		struct markov_export_exit_t *narrow = markov_scratch_narrow;
+		for (i = 0; i < num_exits; i++) {
+			narrow[i].node = exits[i].node;
+			narrow[i].count = exits[i].count;
+		}
+		markov_writer_write(writer, narrow, sizeof(struct markov_export_exit_t) * num_exits);
 	}
-	printf("Writing start states... ");
-	fflush(stdout);
-	markov_export_start(file);
-	if (fclose(file)) {
-		printf("Error writing to markov database: %s\n", strerror(errno));
-		exit(1);
+
+	if (alias)
+		markov_writer_write(writer, alias, sizeof(struct markov_export_alias_t) * num_exits);
+	return export_num_exits;
+}
+
+// Write the number of exits of a list of exits and the exits with cumulative
+// counts, followed by their alias table if alias tables are enabled
+static inline void markov_write_exits(struct markov_writer_t *writer, int num_exits, const struct markov_exit_t *exits)
+{
+	markov_get_scratch(num_exits);
+	struct markov_export_wide_exit_t *export = markov_scratch_export;
+	int i;
+	for (i = 0; i < num_exits; i++) {
+		export[i].node = exits[i].node->offset;
+		export[i].count = exits[i].count;
 	}
-	printf("done\n");
+
+	markov_write_export_exits(writer, num_exits, export);
 }
 
-// Signal handler to allow interruption
-static void signal_handler(int signal)
+// Compare the strings of two nodes
+static inline int markov_strings_compare(const string_id_t *a, const string_id_t *b)
 {
-	// Shut up compiler warning
-	(void)signal;
-	exit(0);
+	int i;
+	for (i = 0; i < MARKOV_ORDER; i++) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
 }
 
-// Main function, reads each line from the standard input as a word. Empty lines
-// delimit a sentence.
-int main(void)
+// Get the total count of a list of exits
+static inline int64_t markov_exits_total(int num_exits, const struct markov_exit_t *exits)
 {
-	atexit(markov_stats);
-	signal(SIGINT, signal_handler);
-	markov_init();
+	int64_t total = 0;
+	int i;
+	for (i = 0; i < num_exits; i++)
+		total += exits[i].count;
+	return total;
+}
 
-	int counter = 0;
-	int length = 0;
-	const char *sentence[8192];
-	char buffer[8192];
-	while (fgets(buffer, sizeof(buffer), stdin)) {
-		// General progress indicator, shows number of lines processed.
-		counter++;
-		if (counter % 100000 == 0)
-			printf("%d\n", counter);
-
-		// fgets returns a string with a newline at the end, except if we are
-		// at the end of a file that doesn't have a trailing newline.
-		if (buffer[strlen(buffer) - 1] == '\n')
-			buffer[strlen(buffer) - 1] = '\0';
-		else if (!feof(stdin))
-			printf("Word too long\n");
+// Compute the offset of every node in the node section. Each node is directly
+// followed by its exits, in table order, so that every shard covers a
+// contiguous range of the section. The total count of each node decides the
+// size of its exits. Returns the size of the section.
+static inline markov_offset_t markov_layout_nodes(void)
+{
+	// Every word trained on adds at most one to the total count of a node, and
+	// so does every sentence. Unless the model has seen enough of them, no node
+	// can need 64-bit counts and they don't need to be added up.
+	struct markov_pools_t pools;
+	markov_sum_pools(&pools);
+	bool may_be_wide = pools.num_tokens + pools.num_sentences + markov_loaded_count > UINT32_MAX;
 
-		// Empty line means end of sentence
-		if (!buffer[0]) {
-			markov_train(length, sentence);
-			length = 0;
-		} else {
-			sentence[length++] = string_copy(buffer);
-			if (length == 8192) {
-				printf("Sentence too long\n");
-				markov_train(length, sentence);
-				length = 0;
-			}
+	markov_offset_t offset = 0;
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		markov_table[i].offset = offset;
+		unsigned int index;
+		for (index = 0; index <= markov_table[i].mask; index++) {
+			struct markov_node_t *current = markov_table[i].slots[index].node;
+			if (!current)
+				continue;
+
+			int64_t total = may_be_wide ? markov_exits_total(current->num_exits, markov_collect_exits(current)) : 0;
+			current->offset = offset;
+			offset += sizeof(struct markov_export_node_t) + markov_exits_size(markov_export_num_exits(current->num_exits, total));
 		}
 	}
+	markov_free_scratch();
+
+	return offset;
+}
+
+// Write the nodes of a shard and their exits. The string ids of the nodes are
+// taken from the table slots since the node offsets overwrite them.
+static inline void markov_export_shard(struct markov_writer_t *writer, struct markov_shard_t *shard)
+{
+	unsigned int index;
+	for (index = 0; index <= shard->mask; index++) {
+		struct markov_slot_t *slot = &shard->slots[index];
+		struct markov_node_t *current = slot->node;
+		if (!current)
+			continue;
+
+		// Create the node structure
+		struct markov_export_node_t export;
+		int j;
+		for (j = 0; j < MARKOV_ORDER; j++)
+			export.strings[j] = string_offset(slot->strings[j]);
+
+		// Write the node to the file, followed by its number of exits and
+		// its exits
+		markov_writer_write(writer, export.strings, sizeof(export.strings));
+		markov_write_exits(writer, current->num_exits, markov_collect_exits(current));
+	}
+}
+
+// Export thread writing the node section. Threads take shards in turn and write
+// each one at its own offset.
+static void *markov_export_nodes(void *arg)
+{
+	(void)arg;
+	struct trace_span_t span;
+	trace_begin(&span, "node export");
+	markov_offset_t base = markov_export_header.sections[MARKOV_SECTION_NODES].offset;
+	struct markov_writer_t writer;
+	markov_writer_init(&writer, markov_export_fd, "markov", base);
+
+	int i;
+	while ((i = __sync_fetch_and_add(&markov_export_next_shard, 1)) < MARKOV_SHARDS) {
+		writer.offset = base + markov_table[i].offset;
+		markov_export_shard(&writer, &markov_table[i]);
+		markov_writer_flush(&writer);
+	}
+
+	markov_writer_close(&writer);
+	markov_free_scratch();
+	trace_end(&span);
+	return NULL;
+}
+
+// Export thread writing the start states section
+static void *markov_export_start(void *arg)
+{
+	(void)arg;
+	struct trace_span_t span;
+	trace_begin(&span, "start export");
+	struct markov_writer_t writer;
+	markov_writer_init(&writer, markov_export_fd, "start", markov_export_header.sections[MARKOV_SECTION_START].offset);
+
+	// Collect the start states into a list
+	struct markov_exit_t *start = markov_get_scratch(markov_num_start);
+	int num_start = 0;
+	struct table_iter_t iter;
+	struct markov_start_t *current;
+	table_iter_init(&iter, &markov_start_table);
+	while ((current = (struct markov_start_t *)table_iter_next(&iter))) {
+		start[num_start].node = current->node;
+		start[num_start].count = current->count;
+		num_start++;
+	}
+
+	// Write them along with their number
+	markov_write_exits(&writer, num_start, start);
+	markov_writer_close(&writer);
+	markov_free_scratch();
+	trace_end(&span);
+	return NULL;
+}
+
+// Export thread writing the string section. The strings are written through
+// stdio, using a separate file descriptor so that the file position is not
+// shared with other threads.
+static void *markov_export_strings(void *arg)
+{
+	(void)arg;
+	struct trace_span_t span;
+	trace_begin(&span, "string export");
+	FILE *file = fopen(markov_export_file, "r+");
+	if (!file) {
+		printf("Error opening string database for writing: %s\n", strerror(errno));
+		exit(1);
+	}
+	setvbuf(file, NULL, _IOFBF, MARKOV_EXPORT_BUFFER_SIZE);
+	fseeko64(file, markov_export_header.sections[MARKOV_SECTION_STRINGS].offset, SEEK_SET);
+	string_export(file);
+	if (fclose(file)) {
+		printf("Error writing to string database: %s\n", strerror(errno));
+		exit(1);
+	}
+	trace_end(&span);
+	return NULL;
+}
+
+// Round an offset in the model file up to the start of a section
+static inline markov_offset_t markov_align_section(markov_offset_t offset)
+{
+	return (offset + MARKOV_SECTION_ALIGN - 1) & ~(markov_offset_t)(MARKOV_SECTION_ALIGN - 1);
+}
+
+// Place a section of the model file after the previous one
+static inline void markov_layout_section(int section, markov_offset_t size)
+{
+	struct markov_header_t *header = &markov_export_header;
+	markov_offset_t offset = sizeof(struct markov_header_t);
+	if (section)
+		offset = header->sections[section - 1].offset + header->sections[section - 1].size;
+	header->sections[section].offset = markov_align_section(offset);
+	header->sections[section].size = size;
+}
+
+// Compute the checksums of the written sections and of the header
+static inline void markov_export_checksums(const char *file)
+{
+	struct markov_header_t *header = &markov_export_header;
+	int64_t length;
+	char *data = mmap_file(file, &length);
+	int i;
+	for (i = 0; i < MARKOV_SECTIONS; i++)
+		header->sections[i].checksum = hash_checksum(data + header->sections[i].offset, header->sections[i].size);
+	munmap(data, length);
+
+	header->checksum = model_header_checksum(header);
+}
+
+// Fill in the header of the model being exported, and lay out its sections. The
+// number of start states is given as stored in the start states section.
+static inline void markov_export_layout(int64_t num_nodes, uint32_t num_start, markov_offset_t nodes_size)
+{
+	struct markov_header_t *header = &markov_export_header;
+	memset(header, 0, sizeof(struct markov_header_t));
+	header->magic = MARKOV_MAGIC;
+	header->version = MARKOV_VERSION;
+	header->order = MARKOV_ORDER;
+	header->flags = markov_export_alias ? MARKOV_FLAG_ALIAS : 0;
+	header->num_strings = string_pool_count;
+	header->num_nodes = num_nodes;
+	header->num_start_states = num_start & ~MARKOV_EXITS_WIDE;
+	header->num_sections = MARKOV_SECTIONS;
+	markov_layout_section(MARKOV_SECTION_STRINGS, string_layout());
+	markov_layout_section(MARKOV_SECTION_NODES, nodes_size);
+	markov_layout_section(MARKOV_SECTION_START, sizeof(num_start) + markov_exits_size(num_start));
+}
+
+// Create the temporary file a model is exported to, with its final size
+static inline void markov_export_create(char *temp_file, const char *file)
+{
+	snprintf(temp_file, PATH_MAX, "%s.tmp", file);
+	markov_export_file = temp_file;
+	markov_export_fd = open(temp_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (markov_export_fd < 0) {
+		printf("Error opening %s for writing: %s\n", temp_file, strerror(errno));
+		exit(1);
+	}
+	struct markov_section_t *last = &markov_export_header.sections[MARKOV_SECTIONS - 1];
+	if (ftruncate64(markov_export_fd, last->offset + last->size)) {
+		printf("Error writing to %s: %s\n", temp_file, strerror(errno));
+		exit(1);
+	}
+}
+
+// Flush the directory containing a file to disk, so that a rename into it
+// survives a crash
+static inline void markov_sync_dir(const char *file)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", file);
+	char *slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || fsync(fd)) {
+		printf("Error syncing directory %s: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+}
+
+// Finish an exported model once all its sections are written. The header is
+// written last, and the temporary file then replaces the old model.
+static inline void markov_export_finish(const char *temp_file, const char *file)
+{
+	struct markov_header_t *header = &markov_export_header;
+	struct trace_span_t span;
+	trace_begin(&span, "checksums");
+	markov_export_checksums(temp_file);
+	trace_end(&span);
+	markov_pwrite(markov_export_fd, "markov", header, sizeof(struct markov_header_t), 0);
+
+	// The data must be on disk before the rename is, or a crash could leave a
+	// corrupt model in place of the previous one
+	if (fsync(markov_export_fd) || close(markov_export_fd)) {
+		printf("Error writing to %s: %s\n", temp_file, strerror(errno));
+		exit(1);
+	}
+	if (rename(temp_file, file)) {
+		printf("Error renaming %s to %s: %s\n", temp_file, file, strerror(errno));
+		exit(1);
+	}
+	markov_sync_dir(file);
+}
+
+// Export the markov model to a file. The offsets of all strings and nodes are
+// computed first, after which the string, node and start states sections are
+// all written by separate threads. The model is written to a temporary file
+// which then replaces the old model, so readers never see a partial model.
+static inline void markov_export(const char *file)
+{
+	printf("Writing model... ");
+	fflush(stdout);
+	markov_finish_rehash();
+
+	// Lay out the model file
+	struct trace_span_t span;
+	trace_begin(&span, "layout");
+	int64_t num_nodes = 0;
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++)
+		num_nodes += markov_table[i].count;
+	int64_t start_total = 0;
+	struct table_iter_t iter;
+	struct markov_start_t *start;
+	table_iter_init(&iter, &markov_start_table);
+	while ((start = (struct markov_start_t *)table_iter_next(&iter)))
+		start_total += start->count;
+	markov_export_layout(num_nodes, markov_export_num_exits(markov_num_start, start_total), markov_layout_nodes());
+	trace_end(&span);
+	char temp_file[PATH_MAX];
+	markov_export_create(temp_file, file);
+
+	// Start the export threads
+	pthread_t threads[MARKOV_MAX_THREADS + 2];
+	int num_threads = 0;
+	if (pthread_create(&threads[num_threads++], NULL, markov_export_strings, NULL) ||
+	    pthread_create(&threads[num_threads++], NULL, markov_export_start, NULL)) {
+		printf("Error creating export thread\n");
+		exit(1);
+	}
+	markov_export_next_shard = 0;
+	for (i = 0; i < markov_num_threads; i++) {
+		if (pthread_create(&threads[num_threads++], NULL, markov_export_nodes, NULL)) {
+			printf("Error creating export thread\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	markov_export_finish(temp_file, file);
+	printf("done\n");
+}
+
+// Get the name of a file of out-of-core training
+static inline void markov_spill_name(char *name, const char *kind, int index)
+{
+	snprintf(name, PATH_MAX, "%s/markov-%s-%d", markov_spill_dir, kind, index);
+}
+
+// Open a file of out-of-core training
+static inline FILE *markov_spill_open(const char *kind, int index, const char *mode)
+{
+	char name[PATH_MAX];
+	markov_spill_name(name, kind, index);
+	FILE *file = fopen(name, mode);
+	if (!file) {
+		printf("Error opening %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+	return file;
+}
+
+// Close a file of out-of-core training, and delete it if requested
+static inline void markov_spill_close(FILE *file, const char *kind, int index, bool remove)
+{
+	char name[PATH_MAX];
+	markov_spill_name(name, kind, index);
+	if (fclose(file)) {
+		printf("Error writing to %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+	if (remove)
+		unlink(name);
+}
+
+// Compare two n-gram records by node, then by next string
+static inline int markov_gram_compare(const struct markov_gram_t *a, const struct markov_gram_t *b)
+{
+	int result = markov_strings_compare(a->strings, b->strings);
+	if (result)
+		return result;
+	return (a->next > b->next) - (a->next < b->next);
+}
+
+// Compare two n-gram records for qsort()
+static int markov_gram_sort(const void *a, const void *b)
+{
+	return markov_gram_compare(a, b);
+}
+
+// Write an n-gram record to a run
+static inline void markov_gram_write(FILE *file, const struct markov_gram_t *gram)
+{
+	if (!fwrite(gram, sizeof(struct markov_gram_t), 1, file)) {
+		printf("Error writing run: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+// Sort the n-gram records collected by the current thread, add up the counts
+// of equal records, and write them out as a new run
+static inline void markov_spill_flush(void)
+{
+	if (!markov_num_grams)
+		return;
+
+	struct trace_span_t span;
+	trace_begin(&span, "spill");
+	qsort(markov_grams, markov_num_grams, sizeof(struct markov_gram_t), markov_gram_sort);
+	int64_t num_grams = 0;
+	int64_t i;
+	for (i = 1; i < markov_num_grams; i++) {
+		if (!markov_gram_compare(&markov_grams[num_grams], &markov_grams[i]) &&
+		    markov_grams[num_grams].count <= UINT32_MAX - markov_grams[i].count)
+			markov_grams[num_grams].count += markov_grams[i].count;
+		else
+			markov_grams[++num_grams] = markov_grams[i];
+	}
+	num_grams++;
+
+	int run = __sync_fetch_and_add(&markov_num_runs, 1);
+	FILE *file = markov_spill_open("run", run, "w");
+	if (fwrite(markov_grams, sizeof(struct markov_gram_t), num_grams, file) != (size_t)num_grams) {
+		printf("Error writing run: %s\n", strerror(errno));
+		exit(1);
+	}
+	markov_spill_close(file, "run", run, false);
+	markov_num_grams = 0;
+	trace_end(&span);
+}
+
+// Write out the remaining n-gram records of the current thread and release its
+// buffer
+static inline void markov_spill_finish(void)
+{
+	markov_spill_flush();
+	free(markov_grams);
+	markov_grams = NULL;
+}
+
+// Add an n-gram record to the buffer of the current thread, writing the buffer
+// out as a run when it is full
+static inline void markov_spill_add(const string_id_t *strings, string_id_t next)
+{
+	if (!markov_grams) {
+		markov_grams = malloc(sizeof(struct markov_gram_t) * markov_spill_capacity);
+		assert(markov_grams);
+	}
+	if (markov_num_grams == markov_spill_capacity)
+		markov_spill_flush();
+
+	struct markov_gram_t *gram = &markov_grams[markov_num_grams++];
+	memcpy(gram->strings, strings, sizeof(gram->strings));
+	gram->next = next;
+	gram->count = 1;
+}
+
+// Train the model out of core using the given sentence. This records the same
+// nodes, exits and start states as markov_train() would add.
+static inline void markov_spill_train(int length, const string_id_t *sentence)
+{
+	// Ignore empty sentences
+	if (!length)
+		return;
+
+	// Handle sentences shorter than MARKOV_ORDER
+	string_id_t buffer[MARKOV_ORDER];
+	int i;
+	if (length < MARKOV_ORDER) {
+		for (i = 0; i < length; i++)
+			buffer[i] = sentence[i];
+		for (i = length; i < MARKOV_ORDER; i++)
+			buffer[i] = 0;
+		markov_spill_add(buffer, MARKOV_GRAM_START);
+		return;
+	}
+
+	// First node and middle nodes
+	markov_spill_add(sentence, MARKOV_GRAM_START);
+	for (i = MARKOV_ORDER; i < length; i++)
+		markov_spill_add(sentence + i - MARKOV_ORDER, sentence[i]);
+
+	// Last node, which has no exits of its own and so needs a record to
+	// exist
+	markov_spill_add(sentence + length - MARKOV_ORDER, 0);
+	for (i = 0; i < MARKOV_ORDER - 1; i++)
+		buffer[i] = sentence[length - MARKOV_ORDER + 1 + i];
+	buffer[MARKOV_ORDER - 1] = 0;
+	markov_spill_add(buffer, MARKOV_GRAM_NODE);
+}
+
+// Open a run for reading, and read its first record
+static inline void markov_run_open(struct markov_run_t *run, int index)
+{
+	run->file = markov_spill_open("run", index, "r");
+	setvbuf(run->file, NULL, _IOFBF, MARKOV_MERGE_BUFFER_SIZE);
+}
+
+// Read the next n-gram record of a run. Returns false at the end of the run.
+static inline bool markov_run_read(struct markov_run_t *run)
+{
+	if (fread(&run->gram, sizeof(struct markov_gram_t), 1, run->file))
+		return true;
+	if (ferror(run->file)) {
+		printf("Error reading run: %s\n", strerror(errno));
+		exit(1);
+	}
+	return false;
+}
+
+// Move a run down a heap of runs ordered by their current record, until the
+// heap is in order again
+static inline void markov_heap_down(struct markov_run_t **heap, int size, int index)
+{
+	for (;;) {
+		int smallest = index;
+		int child = index * 2 + 1;
+		if (child < size && markov_gram_compare(&heap[child]->gram, &heap[smallest]->gram) < 0)
+			smallest = child;
+		if (child + 1 < size && markov_gram_compare(&heap[child + 1]->gram, &heap[smallest]->gram) < 0)
+			smallest = child + 1;
+		if (smallest == index)
+			return;
+
+		struct markov_run_t *run = heap[index];
+		heap[index] = heap[smallest];
+		heap[smallest] = run;
+		index = smallest;
+	}
+}
+
+// Merge a range of runs into a new run, adding up the counts of equal records.
+// The merged runs are deleted.
+static inline void markov_merge_runs(int first, int count)
+{
+	struct trace_span_t span;
+	trace_begin(&span, "merge");
+	struct markov_run_t runs[MARKOV_MERGE_WAYS];
+	struct markov_run_t *heap[MARKOV_MERGE_WAYS];
+	int size = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		markov_run_open(&runs[i], first + i);
+		if (markov_run_read(&runs[i]))
+			heap[size++] = &runs[i];
+	}
+	for (i = size / 2 - 1; i >= 0; i--)
+		markov_heap_down(heap, size, i);
+
+	int output_index = markov_num_runs++;
+	FILE *output = markov_spill_open("run", output_index, "w");
+	setvbuf(output, NULL, _IOFBF, MARKOV_EXPORT_BUFFER_SIZE);
+	struct markov_gram_t current;
+	bool have_current = false;
+	while (size) {
+		struct markov_run_t *run = heap[0];
+		if (have_current && !markov_gram_compare(&current, &run->gram) && current.count <= UINT32_MAX - run->gram.count)
+			current.count += run->gram.count;
+		else {
+			if (have_current)
+				markov_gram_write(output, &current);
+			current = run->gram;
+			have_current = true;
+		}
+
+		if (!markov_run_read(run))
+			heap[0] = heap[--size];
+		markov_heap_down(heap, size, 0);
+	}
+	if (have_current)
+		markov_gram_write(output, &current);
+	markov_spill_close(output, "run", output_index, false);
+
+	for (i = 0; i < count; i++)
+		markov_spill_close(runs[i].file, "run", first + i, true);
+	trace_end(&span);
+}
+
+// Merge all runs into a single one, MARKOV_MERGE_WAYS at a time. Returns the
+// index of the final run.
+static inline int markov_merge_all(void)
+{
+	// Without any input there is still an empty run
+	if (!markov_num_runs) {
+		FILE *file = markov_spill_open("run", markov_num_runs++, "w");
+		markov_spill_close(file, "run", 0, false);
+	}
+
+	int first = 0;
+	while (markov_num_runs - first > 1) {
+		int count = min(markov_num_runs - first, MARKOV_MERGE_WAYS);
+		markov_merge_runs(first, count);
+		first += count;
+	}
+	return first;
+}
+
+// Read the records of the next node from a merged run, whose first record must
+// already have been read. The exits are stored in a growing buffer, holding
+// the next string of each exit in place of its node offset, and the counts of
+// records split for being too large are added back up. Returns the number
+// of exits, or -1 at the end of the run.
+static inline int markov_run_node(struct markov_run_t *run, bool *more, string_id_t *strings, int64_t *start_count,
+                                  struct markov_export_wide_exit_t **exits, int *exits_size)
+{
+	if (!*more)
+		return -1;
+
+	memcpy(strings, run->gram.strings, sizeof(run->gram.strings));
+	*start_count = 0;
+	int num_exits = 0;
+	do {
+		if (run->gram.next == MARKOV_GRAM_START)
+			*start_count += run->gram.count;
+		else if (num_exits && run->gram.next == (*exits)[num_exits - 1].node)
+			(*exits)[num_exits - 1].count += run->gram.count;
+		else if (run->gram.next != MARKOV_GRAM_NODE) {
+			if (num_exits == *exits_size) {
+				*exits_size = max(*exits_size * 2, 256);
+				*exits = realloc(*exits, sizeof(struct markov_export_wide_exit_t) * *exits_size);
+				assert(*exits);
+			}
+			(*exits)[num_exits].node = run->gram.next;
+			(*exits)[num_exits].count = run->gram.count;
+			num_exits++;
+		}
+	} while ((*more = markov_run_read(run)) && !markov_strings_compare(run->gram.strings, strings));
+
+	return num_exits;
+}
+
+// Index of the first node starting with each string in the node index
+static int64_t *markov_index_first;
+
+// Mapped node index, and the number of nodes in it
+static struct markov_index_t *markov_index;
+static int64_t markov_index_count;
+
+// First pass over the merged run: compute the offset of every node, and write
+// it to the node index. Returns the size of the node section.
+static inline markov_offset_t markov_spill_layout(int index, int64_t *num_start, int64_t *start_total)
+{
+	struct markov_run_t run;
+	markov_run_open(&run, index);
+	bool more = markov_run_read(&run);
+	FILE *file = markov_spill_open("index", 0, "w");
+	setvbuf(file, NULL, _IOFBF, MARKOV_EXPORT_BUFFER_SIZE);
+	markov_index_first = malloc(sizeof(int64_t) * (string_pool_count + 2));
+	assert(markov_index_first);
+
+	struct markov_export_wide_exit_t *exits = NULL;
+	int exits_size = 0;
+	struct markov_index_t entry;
+	int64_t start_count;
+	int num_exits;
+	markov_offset_t offset = 0;
+	int64_t num_nodes = 0;
+	string_id_t first = 0;
+	while ((num_exits = markov_run_node(&run, &more, entry.strings, &start_count, &exits, &exits_size)) >= 0) {
+		// Nodes are sorted by their first string
+		while (first <= entry.strings[0])
+			markov_index_first[first++] = num_nodes;
+
+		entry.offset = offset;
+		if (!fwrite(&entry, sizeof(entry), 1, file)) {
+			printf("Error writing node index: %s\n", strerror(errno));
+			exit(1);
+		}
+		int64_t total = 0;
+		int i;
+		for (i = 0; i < num_exits; i++)
+			total += exits[i].count;
+		offset += sizeof(struct markov_export_node_t) + markov_exits_size(markov_export_num_exits(num_exits, total));
+		num_nodes++;
+		if (start_count) {
+			(*num_start)++;
+			*start_total += start_count;
+		}
+	}
+	while (first <= (string_id_t)string_pool_count + 1)
+		markov_index_first[first++] = num_nodes;
+
+	free(exits);
+	markov_spill_close(run.file, "run", index, false);
+	markov_spill_close(file, "index", 0, false);
+	markov_index_count = num_nodes;
+	return offset;
+}
+
+// Look up the offset of a node in the node index
+static inline markov_offset_t markov_index_find(const string_id_t *strings)
+{
+	int64_t low = markov_index_first[strings[0]];
+	int64_t high = markov_index_first[strings[0] + 1];
+	while (low < high) {
+		int64_t middle = low + (high - low) / 2;
+		int result = markov_strings_compare(markov_index[middle].strings, strings);
+		if (!result)
+			return markov_index[middle].offset;
+		if (result < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	printf("Node missing from the node index\n");
+	exit(1);
+}
+
+// Second pass over the merged run: write the node and start states sections,
+// looking up the offsets of exits in the node index. The start states are
+// collected in memory since their alias table needs all of them.
+static inline void markov_spill_write(int index, int64_t num_start)
+{
+	char name[PATH_MAX];
+	markov_spill_name(name, "index", 0);
+	markov_index = mmap_file(name, NULL);
+
+	struct markov_run_t run;
+	markov_run_open(&run, index);
+	bool more = markov_run_read(&run);
+	struct markov_writer_t writer;
+	markov_writer_init(&writer, markov_export_fd, "markov", markov_export_header.sections[MARKOV_SECTION_NODES].offset);
+	struct markov_export_wide_exit_t *start = malloc(sizeof(struct markov_export_wide_exit_t) * (num_start + 1));
+	assert(start);
+
+	struct markov_export_wide_exit_t *exits = NULL;
+	int exits_size = 0;
+	string_id_t strings[MARKOV_ORDER];
+	string_id_t target[MARKOV_ORDER];
+	int64_t start_count;
+	int num_exits;
+	markov_offset_t offset = 0;
+	num_start = 0;
+	while ((num_exits = markov_run_node(&run, &more, strings, &start_count, &exits, &exits_size)) >= 0) {
+		if (start_count) {
+			start[num_start].node = offset;
+			start[num_start].count = start_count;
+			num_start++;
+		}
+
+		// Create the node structure
+		struct markov_export_node_t export;
+		int i;
+		for (i = 0; i < MARKOV_ORDER; i++)
+			export.strings[i] = string_offset(strings[i]);
+
+		// Find the nodes the exits lead to
+		memcpy(target, strings + 1, sizeof(string_id_t) * (MARKOV_ORDER - 1));
+		for (i = 0; i < num_exits; i++) {
+			target[MARKOV_ORDER - 1] = exits[i].node;
+			exits[i].node = markov_index_find(target);
+		}
+
+		markov_writer_write(&writer, export.strings, sizeof(export.strings));
+		offset += sizeof(struct markov_export_node_t) + markov_exits_size(markov_write_export_exits(&writer, num_exits, exits));
+	}
+	markov_writer_close(&writer);
+	free(exits);
+	markov_spill_close(run.file, "run", index, true);
+
+	// Write the start states
+	markov_writer_init(&writer, markov_export_fd, "start", markov_export_header.sections[MARKOV_SECTION_START].offset);
+	markov_write_export_exits(&writer, num_start, start);
+	markov_writer_close(&writer);
+	free(start);
+
+	if (markov_index)
+		munmap(markov_index, sizeof(struct markov_index_t) * markov_index_count);
+	unlink(name);
+	free(markov_index_first);
+	markov_free_scratch();
+}
+
+// Export a model trained out of core. All runs are merged into one, which
+// holds the records of every node in order. The model is then written in two
+// passes over it, the first laying out the nodes and the second writing them.
+static inline void markov_spill_export(const char *file)
+{
+	markov_spill_finish();
+	printf("Merging %d runs... ", markov_num_runs);
+	fflush(stdout);
+	int index = markov_merge_all();
+	printf("done\n");
+
+	printf("Writing model... ");
+	fflush(stdout);
+	struct trace_span_t span;
+	trace_begin(&span, "layout");
+	int64_t num_start = 0;
+	int64_t start_total = 0;
+	markov_offset_t nodes_size = markov_spill_layout(index, &num_start, &start_total);
+	markov_export_layout(markov_index_count, markov_export_num_exits(num_start, start_total), nodes_size);
+	trace_end(&span);
+	char temp_file[PATH_MAX];
+	markov_export_create(temp_file, file);
+
+	// The strings are written by their own thread meanwhile
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, markov_export_strings, NULL)) {
+		printf("Error creating export thread\n");
+		exit(1);
+	}
+	trace_begin(&span, "node export");
+	markov_spill_write(index, num_start);
+	trace_end(&span);
+	pthread_join(thread, NULL);
+
+	markov_export_finish(temp_file, file);
+	printf("done\n");
+}
+
+// Get the id of a string from its offset in a loaded string section
+static inline string_id_t markov_load_id(const char *stringdb, string_offset_t offset)
+{
+	if (offset == -1)
+		return 0;
+
+	string_id_t id;
+	memcpy(&id, stringdb + offset - sizeof(string_length_t), sizeof(string_id_t));
+	return id;
+}
+
+// Get the node which was created for a node of a loaded node section
+static inline struct markov_node_t *markov_load_node(const char *markovdb, markov_offset_t offset)
+{
+	struct markov_node_t *node;
+	memcpy(&node, ((struct markov_export_node_t *)(markovdb + offset))->strings, sizeof(node));
+	return node;
+}
+
+// Add all the strings of a loaded string section to the string pool. The model
+// is mapped privately, and the length in front of each string is replaced by
+// the id of the string, so that string offsets can be turned into ids without a
+// search.
+static inline void markov_load_strings(char *stringdb, int64_t length)
+{
+	char *pos = stringdb;
+	while (pos < stringdb + length) {
+		string_length_t string_length;
+		memcpy(&string_length, pos, sizeof(string_length_t));
+
+		string_id_t id = string_copy(pos + sizeof(string_length_t));
+		memcpy(pos, &id, sizeof(string_id_t));
+
+		pos += sizeof(string_length_t) + string_length + 1;
+	}
+}
+
+// Get the size of the exits of a loaded node, along with their alias table if
+// the model has alias tables
+static inline markov_offset_t markov_load_exits_size(uint32_t num_exits, bool alias)
+{
+	markov_offset_t size = markov_exit_size(num_exits);
+	if (alias)
+		size += sizeof(struct markov_export_alias_t);
+	return size * (num_exits & ~MARKOV_EXITS_WIDE);
+}
+
+// Add the exits of a loaded node to the model, or add them as start states if
+// node is NULL, turning cumulative counts back into counts
+static inline void markov_load_exits(struct markov_node_t *node, const char *markovdb, uint32_t num_exits, const struct markov_export_exit_t *exits)
+{
+	int exit_size = markov_exit_size(num_exits);
+	uint64_t total_count = 0;
+	uint32_t i;
+	for (i = 0; i < (num_exits & ~MARKOV_EXITS_WIDE); i++) {
+		const struct markov_export_exit_t *exit = (const struct markov_export_exit_t *)((const char *)exits + exit_size * i);
+		uint64_t count = exit->count;
+		if (num_exits & MARKOV_EXITS_WIDE)
+			count = ((const struct markov_export_wide_exit_t *)exit)->count;
+
+		struct markov_node_t *next = markov_load_node(markovdb, exit->node);
+		if (node)
+			markov_add_exit(node, next, count - total_count);
+		else
+			markov_add_start(next, count - total_count);
+		total_count = count;
+	}
+	markov_loaded_count += total_count;
+}
+
+// Add all the nodes and exits of a loaded node section to the model. The model
+// is mapped privately, and the first pass replaces the key of each node with a
+// pointer to the node it created, so that exits can be resolved directly in
+// the second pass.
+static inline void markov_load_nodes(const char *stringdb, char *markovdb, int64_t length, bool alias)
+{
+	// First pass: create the nodes
+	markov_offset_t offset = 0;
+	while (offset < length) {
+		struct markov_export_node_t *export = (struct markov_export_node_t *)(markovdb + offset);
+		string_id_t strings[MARKOV_ORDER];
+		int i;
+		for (i = 0; i < MARKOV_ORDER; i++)
+			strings[i] = markov_load_id(stringdb, export->strings[i]);
+
+		struct markov_node_t *node = markov_get_node(strings);
+		memcpy(export->strings, &node, sizeof(node));
+
+		offset += sizeof(struct markov_export_node_t) + markov_load_exits_size(export->num_exits, alias);
+	}
+
+	// Second pass: add the exits
+	offset = 0;
+	while (offset < length) {
+		struct markov_export_node_t *export = (struct markov_export_node_t *)(markovdb + offset);
+		markov_load_exits(markov_load_node(markovdb, offset), markovdb, export->num_exits, export->exits);
+		offset += sizeof(struct markov_export_node_t) + markov_load_exits_size(export->num_exits, alias);
+	}
+}
+
+// Add all the start states of a loaded start states section to the model
+static inline void markov_load_start(const char *markovdb, struct markov_export_start_t *startdb)
+{
+	markov_load_exits(NULL, markovdb, startdb->num_start_states, startdb->start_states);
+}
+
+// Load an existing model so that training can continue from it
+static inline void markov_load(const char *file)
+{
+	printf("Loading model... ");
+	fflush(stdout);
+
+	struct model_t model;
+	model_map(&model, file, PROT_READ | PROT_WRITE, MAP_PRIVATE, true);
+
+	char *stringdb = model_section(&model, MARKOV_SECTION_STRINGS);
+	char *markovdb = model_section(&model, MARKOV_SECTION_NODES);
+	markov_load_strings(stringdb, model_section_size(&model, MARKOV_SECTION_STRINGS));
+	markov_load_nodes(stringdb, markovdb, model_section_size(&model, MARKOV_SECTION_NODES), model.header->flags & MARKOV_FLAG_ALIAS);
+	markov_load_start(markovdb, model_section(&model, MARKOV_SECTION_START));
+	model_unmap(&model);
+
+	printf("done\n");
+}
+
+// Get an empty batch, reusing a processed one if possible
+static inline struct markov_batch_t *markov_get_batch(void)
+{
+	struct markov_batch_t *batch = NULL;
+	pthread_mutex_lock(&markov_queue_lock);
+	if (markov_num_free_batches)
+		batch = markov_free_batches[--markov_num_free_batches];
+	pthread_mutex_unlock(&markov_queue_lock);
+
+	if (!batch) {
+		batch = malloc(sizeof(struct markov_batch_t));
+		assert(batch);
+		batch->size = MARKOV_BATCH_SIZE;
+		batch->text = malloc(batch->size);
+		assert(batch->text);
+		batch->ids = NULL;
+		batch->ids_size = 0;
+	}
+	batch->length = 0;
+	return batch;
+}
+
+// Return a processed batch to the free list
+static inline void markov_put_batch(struct markov_batch_t *batch)
+{
+	pthread_mutex_lock(&markov_queue_lock);
+	markov_free_batches[markov_num_free_batches++] = batch;
+	markov_queue_busy--;
+	pthread_cond_broadcast(&markov_queue_cond);
+	pthread_mutex_unlock(&markov_queue_lock);
+}
+
+// Append a word to a batch, growing it until the word fits
+static inline void markov_batch_append(struct markov_batch_t *batch, const char *word, int length)
+{
+	if (batch->length + length > batch->size) {
+		while (batch->length + length > batch->size)
+			batch->size *= 2;
+		batch->text = realloc(batch->text, batch->size);
+		if (!batch->text) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(batch->text + batch->length, word, length);
+	batch->length += length;
+}
+
+// Add a batch to the queue, waiting if the queue is full
+static inline void markov_queue_push(struct markov_batch_t *batch)
+{
+	pthread_mutex_lock(&markov_queue_lock);
+	while (markov_queue_count == MARKOV_QUEUE_SIZE)
+		pthread_cond_wait(&markov_queue_cond, &markov_queue_lock);
+	markov_queue[(markov_queue_head + markov_queue_count++) % MARKOV_QUEUE_SIZE] = batch;
+	pthread_cond_broadcast(&markov_queue_cond);
+	pthread_mutex_unlock(&markov_queue_lock);
+}
+
+// Wait until all queued batches have been processed
+static inline void markov_queue_wait_idle(void)
+{
+	pthread_mutex_lock(&markov_queue_lock);
+	while (markov_queue_count || markov_queue_busy)
+		pthread_cond_wait(&markov_queue_cond, &markov_queue_lock);
+	pthread_mutex_unlock(&markov_queue_lock);
+}
+
+// Take a batch from the queue. Returns NULL once the queue is empty and all
+// input has been read.
+static inline struct markov_batch_t *markov_queue_pop(void)
+{
+	struct markov_batch_t *batch = NULL;
+	pthread_mutex_lock(&markov_queue_lock);
+	while (!markov_queue_count && !markov_queue_done)
+		pthread_cond_wait(&markov_queue_cond, &markov_queue_lock);
+	if (markov_queue_count) {
+		batch = markov_queue[markov_queue_head];
+		markov_queue_head = (markov_queue_head + 1) % MARKOV_QUEUE_SIZE;
+		markov_queue_count--;
+		markov_queue_busy++;
+		pthread_cond_broadcast(&markov_queue_cond);
+	}
+	pthread_mutex_unlock(&markov_queue_lock);
+	return batch;
+}
+
+// Intern all the words of a batch
+static inline void markov_intern_batch(struct markov_batch_t *batch)
+{
+	batch->num_ids = 0;
+	char *word = batch->text;
+	char *end = batch->text + batch->length;
+	while (word < end) {
+		if (batch->num_ids == batch->ids_size) {
+			batch->ids_size = max(batch->ids_size * 2, 0x10000);
+			batch->ids = realloc(batch->ids, sizeof(string_id_t) * batch->ids_size);
+			assert(batch->ids);
+		}
+
+		int word_length = strlen(word);
+		batch->ids[batch->num_ids++] = word_length ? string_copy(word) : 0;
+		word += word_length + 1;
+	}
+}
+
+// Train the model on the sentences of an interned batch
+static inline void markov_train_ids(struct markov_batch_t *batch)
+{
+	int64_t num_tokens = 0;
+	int64_t num_sentences = 0;
+	int start = 0;
+	int i;
+	for (i = 0; i < batch->num_ids; i++) {
+		if (batch->ids[i])
+			continue;
+
+		int length = i - start;
+		if (markov_spill_dir)
+			markov_spill_train(length, batch->ids + start);
+		else
+			markov_train(length, batch->ids + start);
+		num_tokens += length;
+		num_sentences++;
+		start = i + 1;
+	}
+
+	markov_local->num_tokens += num_tokens;
+	markov_local->num_sentences += num_sentences;
+}
+
+// Intern all the words of a batch and train the model on its sentences
+static inline void markov_train_batch(struct markov_batch_t *batch)
+{
+	struct trace_span_t span;
+	trace_begin(&span, "intern");
+	markov_intern_batch(batch);
+	trace_end(&span);
+
+	trace_begin(&span, "train");
+	markov_train_ids(batch);
+	trace_end(&span);
+}
+
+// Training thread, processes batches until the input is exhausted
+static void *markov_worker(void *arg)
+{
+	markov_local = arg;
+	trace_thread_name("training %d", (int)(markov_local - markov_pools));
+
+	struct markov_batch_t *batch;
+	while ((batch = markov_queue_pop())) {
+		markov_train_batch(batch);
+		markov_put_batch(batch);
+	}
+	if (markov_spill_dir)
+		markov_spill_finish();
+
+	return NULL;
+}
+
+// Get the number of elements of the exit storage of a node which is counted as
+// large pool usage, matching the accounting in markov_add_exit_locked()
+static inline int markov_large_size(int num_exits)
+{
+	int size = 256;
+	int i;
+	for (i = 256; i < num_exits; i *= 2)
+		size += i + i / 2;
+	return size;
+}
+
+// Release the exit storage of a node
+static inline void markov_free_exits(struct markov_node_t *node)
+{
+	int num_exits = node->num_exits;
+	if (!num_exits)
+		return;
+
+	if (num_exits <= 16)
+		mempool_free(&markov_local->exitpool_small[num_exits - 1], node->exits);
+	else if (num_exits <= 32)
+		mempool_free(&markov_local->exitpool_32, node->exits);
+	else if (num_exits <= 64)
+		mempool_free(&markov_local->exitpool_64, node->exits);
+	else if (num_exits <= 128)
+		mempool_free(&markov_local->exitpool_128, node->exits);
+	else {
+		int table_size = next_power_of_2(num_exits);
+		int i;
+		for (i = 0; i < table_size; i++) {
+			struct markov_hash_exit_t *current = node->hashtable[i];
+			while (current) {
+				struct markov_hash_exit_t *next = current->next;
+				mempool_free(&markov_local->hashexitpool, current);
+				current = next;
+			}
+		}
+		free(node->hashtable);
+		markov_local->largepool_count--;
+		markov_local->largepool_total -= markov_large_size(num_exits);
+	}
+	node->num_exits = 0;
+}
+
+// Get the memory used by the model, as reported by the pool counters and the
+// table sizes
+static inline int64_t markov_memory_usage(void)
+{
+	struct markov_pools_t pools;
+	markov_sum_pools(&pools);
+	int64_t usage = (int64_t)pools.nodepool.count * sizeof(struct markov_node_t);
+	usage += (int64_t)pools.hashexitpool.count * sizeof(struct markov_hash_exit_t);
+	int i;
+	for (i = 0; i < 16; i++)
+		usage += (int64_t)pools.exitpool_small[i].count * (i + 1) * sizeof(struct markov_exit_t);
+	usage += (int64_t)pools.exitpool_32.count * 32 * sizeof(struct markov_exit_t);
+	usage += (int64_t)pools.exitpool_64.count * 64 * sizeof(struct markov_exit_t);
+	usage += (int64_t)pools.exitpool_128.count * 128 * sizeof(struct markov_exit_t);
+	usage += (int64_t)pools.largepool_total * sizeof(struct markov_exit_t);
+	usage += string_mem_usage;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		usage += (int64_t)(markov_table[i].mask + 1) * sizeof(struct markov_slot_t);
+		if (markov_table[i].old_slots)
+			usage += (int64_t)(markov_table[i].old_mask + 1) * sizeof(struct markov_slot_t);
+	}
+	usage += table_memory(&string_table) + table_memory(&markov_start_table);
+	return usage;
+}
+
+// Check if a node is a dead end: it does not end a sentence, but all its exits
+// have been pruned. The string ids of the node must be in place.
+static inline bool markov_dead_end(struct markov_node_t *node)
+{
+	return !node->num_exits && node->strings[MARKOV_ORDER - 1];
+}
+
+// Remove the exits of a node with a count of at most the threshold, or which
+// lead to a dead end, and return the total count removed. The node keeps its
+// remaining exits in order.
+static inline int64_t markov_prune_exits(struct markov_node_t *node, int threshold)
+{
+	int num_exits = node->num_exits;
+	struct markov_exit_t *exits = markov_get_scratch(num_exits);
+	if (num_exits <= 128)
+		memcpy(exits, node->exits, sizeof(struct markov_exit_t) * num_exits);
+	else
+		markov_collect_exits(node);
+
+	int num_kept = 0;
+	int64_t removed = 0;
+	int i;
+	for (i = 0; i < num_exits; i++) {
+		if (exits[i].count <= threshold || markov_dead_end(exits[i].node))
+			removed += exits[i].count;
+		else
+			exits[num_kept++] = exits[i];
+	}
+	if (num_kept == num_exits)
+		return 0;
+
+	markov_free_exits(node);
+	for (i = 0; i < num_kept; i++)
+		markov_add_exit_locked(node, exits[i].node, exits[i].count);
+
+	markov_pruned_exits += num_exits - num_kept;
+	return removed;
+}
+
+// Remove a slot from a shard, shifting back the slots after it which are not
+// in their home slot
+static inline void markov_remove_slot(struct markov_shard_t *shard, unsigned int index)
+{
+	unsigned int next = (index + 1) & shard->mask;
+	while (shard->slots[next].node && markov_probe_distance(shard, next)) {
+		shard->slots[index] = shard->slots[next];
+		index = next;
+		next = (next + 1) & shard->mask;
+	}
+	shard->slots[index].node = NULL;
+	shard->count--;
+}
+
+// Prune the whole model with the given threshold. Must only be called while no
+// training thread is running. Nodes are marked as used through their offset,
+// which overlaps the string ids that are restored from the table slots at the
+// end.
+static inline void markov_prune_pass(int threshold)
+{
+	int i;
+	unsigned int index;
+
+	// Prune the exits. A node left without exits which does not end a
+	// sentence would be a dead end for the generator, so the exits leading
+	// to it are pruned as well. That can leave more dead ends behind, so this
+	// is repeated until no node loses its last exit.
+	bool dead_ends;
+	do {
+		dead_ends = false;
+		for (i = 0; i < MARKOV_SHARDS; i++) {
+			for (index = 0; index <= markov_table[i].mask; index++) {
+				struct markov_node_t *current = markov_table[i].slots[index].node;
+				if (!current || !current->num_exits)
+					continue;
+
+				markov_pruned_count += markov_prune_exits(current, threshold);
+				if (markov_dead_end(current))
+					dead_ends = true;
+			}
+		}
+	} while (dead_ends);
+
+	// Prune the start states, along with those which are dead ends
+	struct table_iter_t iter;
+	struct markov_start_t *start;
+	table_iter_init(&iter, &markov_start_table);
+	while ((start = (struct markov_start_t *)table_iter_next(&iter))) {
+		if (start->count <= threshold || markov_dead_end(start->node)) {
+			table_iter_remove(&iter);
+			markov_pruned_count += start->count;
+			markov_pruned_starts++;
+			markov_num_start--;
+			mempool_free(&markov_local->hashexitpool, start);
+		}
+	}
+
+	// Clear the marks
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		for (index = 0; index <= markov_table[i].mask; index++) {
+			if (markov_table[i].slots[index].node)
+				markov_table[i].slots[index].node->offset = 0;
+		}
+	}
+
+	// Mark the nodes used by the start states and the exits. Nothing leads
+	// to a dead end anymore, so they are all removed below.
+	table_iter_init(&iter, &markov_start_table);
+	while ((start = (struct markov_start_t *)table_iter_next(&iter)))
+		start->node->offset = 1;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		for (index = 0; index <= markov_table[i].mask; index++) {
+			struct markov_node_t *current = markov_table[i].slots[index].node;
+			if (!current || !current->num_exits)
+				continue;
+
+			struct markov_exit_t *exits = markov_collect_exits(current);
+			int j;
+			for (j = 0; j < current->num_exits; j++)
+				exits[j].node->offset = 1;
+		}
+	}
+
+	// Remove the nodes which have no exits and which nothing leads to. Removing
+	// a slot shifts the following ones back, so the same index is looked at
+	// again.
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		struct markov_shard_t *shard = &markov_table[i];
+		index = 0;
+		while (index <= shard->mask) {
+			struct markov_node_t *current = shard->slots[index].node;
+			if (current && !current->offset && !current->num_exits) {
+				markov_remove_slot(shard, index);
+				mempool_free(&markov_local->nodepool, current);
+				markov_pruned_nodes++;
+			} else
+				index++;
+		}
+	}
+
+	// Restore the string ids of the remaining nodes
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		for (index = 0; index <= markov_table[i].mask; index++) {
+			struct markov_slot_t *slot = &markov_table[i].slots[index];
+			if (slot->node)
+				memcpy(slot->node->strings, slot->strings, sizeof(slot->strings));
+		}
+	}
+}
+
+// Get the total count of all the exits and start states left in the model
+static inline int64_t markov_total_count(void)
+{
+	int64_t total = 0;
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		unsigned int index;
+		for (index = 0; index <= markov_table[i].mask; index++) {
+			struct markov_node_t *current = markov_table[i].slots[index].node;
+			if (!current)
+				continue;
+
+			struct markov_exit_t *exits = markov_collect_exits(current);
+			int j;
+			for (j = 0; j < current->num_exits; j++)
+				total += exits[j].count;
+		}
+	}
+	struct table_iter_t iter;
+	struct markov_start_t *start;
+	table_iter_init(&iter, &markov_start_table);
+	while ((start = (struct markov_start_t *)table_iter_next(&iter)))
+		total += start->count;
+	return total;
+}
+
+// Print how much of the model has been lost to pruning so far
+static inline void markov_prune_report(void)
+{
+	int64_t total = markov_total_count() + markov_pruned_count;
+	printf("Pruned %lld exits, %lld start states and %lld nodes, %.3f%% of all transitions, counts are at most %lld too low\n",
+	       (long long)markov_pruned_exits, (long long)markov_pruned_starts, (long long)markov_pruned_nodes,
+	       total ? 100.0 * markov_pruned_count / total : 0.0, (long long)markov_prune_error);
+}
+
+// Prune the model if it uses more memory than the budget. The threshold is
+// raised until usage drops below three quarters of the budget, so that pruning
+// doesn't happen again right away.
+static inline void markov_check_budget(void)
+{
+	if (!markov_memory_budget || markov_memory_usage() <= markov_memory_budget)
+		return;
+
+	markov_queue_wait_idle();
+	markov_finish_rehash();
+	struct trace_span_t span;
+	trace_begin(&span, "prune");
+
+	// Stop early once a pass frees little, when the budget is too small for
+	// what can't be pruned, like strings and hash tables
+	int64_t before = markov_memory_usage();
+	int64_t usage = before, last;
+	do {
+		markov_prune_pass(++markov_prune_threshold);
+		markov_prune_error += markov_prune_threshold;
+		last = usage;
+		usage = markov_memory_usage();
+	} while (usage > markov_memory_budget / 4 * 3 && last - usage > markov_memory_budget / 64);
+	trace_end(&span);
+
+	printf("Memory usage %lldM over budget, pruned counts up to %d, now %lldM\n",
+	       (long long)(before >> 20), markov_prune_threshold, (long long)(usage >> 20));
+}
+
+// Print the training metrics as a line of JSON on the standard error. All the
+// counters are read without locking, so they may be slightly out of date but
+// training never waits for a report.
+static inline void markov_report_metrics(double start, double *last_time, int64_t *last_tokens)
+{
+	struct markov_pools_t pools;
+	markov_sum_pools(&pools);
+	double now = get_time();
+
+	// Node table
+	int64_t num_nodes = 0;
+	int64_t num_slots = 0;
+	double max_load = 0;
+	int i;
+	for (i = 0; i < MARKOV_SHARDS; i++) {
+		struct markov_shard_t *shard = &markov_table[i];
+		int count = shard->count;
+		unsigned int size = shard->mask + 1;
+		num_nodes += count;
+		num_slots += size;
+		max_load = max(max_load, (double)count / size);
+	}
+
+	flockfile(stderr);
+	fprintf(stderr, "{\"time\": %.3f, \"tokens\": %lld, \"sentences\": %lld, \"tokens_per_sec\": %.0f, ",
+	        now - start, (long long)pools.num_tokens, (long long)pools.num_sentences,
+	        (pools.num_tokens - *last_tokens) / (now - *last_time));
+	fprintf(stderr, "\"nodes\": %lld, \"node_slots\": %lld, \"load_factor\": %.4f, \"max_shard_load\": %.4f, ",
+	        (long long)num_nodes, (long long)num_slots, (double)num_nodes / num_slots, max_load);
+	fprintf(stderr, "\"start_states\": %lld, \"strings\": %u, \"probes\": [", (long long)markov_num_start, string_pool_count);
+	for (i = 0; i < MARKOV_PROBE_BUCKETS; i++)
+		fprintf(stderr, "%s%lld", i ? ", " : "", (long long)pools.probes[i]);
+	fprintf(stderr, "], \"exit_blocks\": {");
+	for (i = 0; i < 16; i++)
+		fprintf(stderr, "\"%d\": %lld, ", i + 1, (long long)pools.exitpool_small[i].count);
+	fprintf(stderr, "\"32\": %lld, \"64\": %lld, \"128\": %lld, \"large\": %lld, \"hash\": %lld}, ",
+	        (long long)pools.exitpool_32.count, (long long)pools.exitpool_64.count, (long long)pools.exitpool_128.count,
+	        (long long)pools.largepool_count, (long long)pools.hashexitpool.count);
+
+	// Bytes held by each pool
+	int64_t exit_bytes = 0;
+	for (i = 0; i < 16; i++)
+		exit_bytes += (int64_t)pools.exitpool_small[i].count * (i + 1) * sizeof(struct markov_exit_t);
+	exit_bytes += (int64_t)pools.exitpool_32.count * 32 * sizeof(struct markov_exit_t);
+	exit_bytes += (int64_t)pools.exitpool_64.count * 64 * sizeof(struct markov_exit_t);
+	exit_bytes += (int64_t)pools.exitpool_128.count * 128 * sizeof(struct markov_exit_t);
+	fprintf(stderr, "\"pool_bytes\": {\"nodes\": %lld, \"hash_exits\": %lld, \"exits\": %lld, \"large\": %lld, \"strings\": %lld, \"node_table\": %lld}, ",
+	        (long long)pools.nodepool.count * (long long)sizeof(struct markov_node_t),
+	        (long long)pools.hashexitpool.count * (long long)sizeof(struct markov_hash_exit_t),
+	        (long long)exit_bytes, (long long)pools.largepool_total * (long long)sizeof(struct markov_exit_t),
+	        (long long)string_mem_usage, (long long)num_slots * (long long)sizeof(struct markov_slot_t));
+	fprintf(stderr, "\"memory\": %lld, \"prune_threshold\": %d, \"runs\": %d}\n",
+	        (long long)markov_memory_usage(), markov_prune_threshold, markov_num_runs);
+	funlockfile(stderr);
+
+	*last_time = now;
+	*last_tokens = pools.num_tokens;
+}
+
+// Metrics thread, reports the training metrics every markov_metrics_interval
+// seconds and whenever SIGUSR1 is received. The signal is blocked in all
+// threads so that only this one picks it up.
+static void *markov_metrics(void *arg)
+{
+	(void)arg;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	struct timespec timeout = {markov_metrics_interval, 0};
+
+	double start = get_time();
+	double last_time = start;
+	int64_t last_tokens = 0;
+	while (true) {
+		if (sigtimedwait(&set, NULL, markov_metrics_interval ? &timeout : NULL) < 0 && errno == EINTR)
+			continue;
+		markov_report_metrics(start, &last_time, &last_tokens);
+	}
+
+	return NULL;
+}
+
+// Hand a full batch over for training and return a new empty batch. When
+// training on a single thread the batch is processed immediately.
+static inline struct markov_batch_t *markov_submit_batch(struct markov_batch_t *batch)
+{
+	if (markov_num_threads == 1) {
+		markov_train_batch(batch);
+		batch->length = 0;
+		markov_check_budget();
+		return batch;
+	}
+
+	markov_queue_push(batch);
+	markov_check_budget();
+	return markov_get_batch();
+}
+
+// Add a word of input to the current batch. An empty word ends the sentence.
+// Words from a dump have no length limit of their own, so they are held to
+// the same one as words read from the input.
+static void markov_input_word(const char *word, int length)
+{
+	// General progress indicator, shows number of lines processed.
+	markov_input_lines++;
+	if (markov_input_lines % 100000 == 0)
+		printf("%d\n", markov_input_lines);
+
+	if (length > MARKOV_READ_SIZE) {
+		printf("Word too long\n");
+		return;
+	}
+
+	struct markov_batch_t *batch = markov_input_batch;
+	markov_batch_append(batch, word, length + 1);
+
+	// Batches are only handed over on sentence boundaries
+	if (!length) {
+		markov_input_length = 0;
+		if (batch->length >= MARKOV_BATCH_SIZE) {
+			trace_end(&markov_input_span);
+			markov_input_batch = markov_submit_batch(batch);
+			trace_begin(&markov_input_span, "ingest");
+		}
+	} else if (++markov_input_length == 8192) {
+		printf("Sentence too long\n");
+		markov_batch_append(batch, "", 1);
+		markov_input_length = 0;
+	}
+}
+
+// Read input with a word on each line. The input is read in large blocks and
+// split into lines in place.
+static inline void markov_read_words(FILE *file)
+{
+	char *buffer = malloc(MARKOV_READ_SIZE + 1);
+	assert(buffer);
+	size_t length = 0;
+	bool eof = false;
+	while (!eof) {
+		size_t wanted = MARKOV_READ_SIZE - length;
+		size_t count = fread(buffer + length, 1, wanted, file);
+		eof = count < wanted;
+		length += count;
+
+		// Hand over every complete line
+		char *word = buffer;
+		char *end = buffer + length;
+		char *newline;
+		while ((newline = (char *)scan_find(word, end, '\n')) != end) {
+			*newline = '\0';
+			markov_input_word(word, newline - word);
+			word = newline + 1;
+		}
+
+		// A line which doesn't fit in the buffer is split, and the last line
+		// may not end with a newline
+		if (word == buffer && length == MARKOV_READ_SIZE)
+			printf("Word too long\n");
+		else if (!eof || word == end) {
+			length = end - word;
+			memmove(buffer, word, length);
+			continue;
+		}
+		*end = '\0';
+		markov_input_word(word, end - word);
+		length = 0;
+	}
+	free(buffer);
+}
+
+// Signal handler to allow interruption
+static void signal_handler(int signal)
+{
+	// Shut up compiler warning
+	(void)signal;
+	exit(0);
+}
+
+// Main function, reads each line from the standard input as a word. Empty lines
+// delimit a sentence. With -w the standard input is a MediaWiki XML dump
+// instead, which may be compressed with gzip or bzip2. With -H the tables, the
+// string blocks and the memory pools are backed by transparent huge pages.
+int main(int argc, char **argv)
+{
+	const char *model_file = "model";
+	const char *resume_file = NULL;
+	bool wiki = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "aHi:j:M:o:r:t:T:w")) != -1) {
+		switch (opt) {
+		case 'a':
+			markov_export_alias = true;
+			break;
+		case 'H':
+			arena_huge_pages = true;
+			break;
+		case 'i':
+			markov_metrics_interval = atoi(optarg);
+			break;
+		case 'M':
+			markov_memory_budget = atoll(optarg) << 20;
+			break;
+		case 'o':
+			model_file = optarg;
+			break;
+		case 'r':
+			resume_file = optarg;
+			break;
+		case 't':
+			trace_open(optarg);
+			break;
+		case 'T':
+			markov_spill_dir = optarg;
+			break;
+		case 'w':
+			wiki = true;
+			break;
+		case 'j':
+			markov_num_threads = atoi(optarg);
+			if (markov_num_threads < 1 || markov_num_threads > MARKOV_MAX_THREADS) {
+				printf("Number of threads must be between 1 and %d\n", MARKOV_MAX_THREADS);
+				return 1;
+			}
+			break;
+		default:
+			printf("Usage: %s [-a] [-H] [-i seconds] [-j threads] [-M megabytes] [-o model] [-r model] [-t trace] [-T directory] [-w]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// When training out of core the memory budget is for the n-gram records
+	// of the training threads
+	if (markov_spill_dir) {
+		if (resume_file) {
+			printf("Can't continue from a model when training out of core\n");
+			return 1;
+		}
+		int64_t budget = markov_memory_budget ? markov_memory_budget : MARKOV_SPILL_DEFAULT_BUDGET;
+		markov_spill_capacity = max(budget / markov_num_threads / (int64_t)sizeof(struct markov_gram_t), 1);
+		markov_memory_budget = 0;
+	}
+
+	atexit(markov_stats);
+	signal(SIGINT, signal_handler);
+	markov_init();
+
+	// Report metrics from a thread of their own. SIGUSR1 is blocked before
+	// any other thread is started, so that they all inherit the mask.
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_t metrics_thread;
+	if (pthread_create(&metrics_thread, NULL, markov_metrics, NULL)) {
+		printf("Error creating metrics thread\n");
+		exit(1);
+	}
+
+	// Continue from a previously exported model
+	struct trace_span_t span;
+	trace_thread_name("main", 0);
+	if (resume_file) {
+		trace_begin(&span, "load");
+		markov_load(resume_file);
+		trace_end(&span);
+	}
+
+	// Start the training threads. The reader thread only fills batches when
+	// there are multiple threads.
+	pthread_t threads[MARKOV_MAX_THREADS];
+	int i;
+	if (markov_num_threads > 1) {
+		for (i = 0; i < markov_num_threads; i++) {
+			if (pthread_create(&threads[i], NULL, markov_worker, &markov_pools[i])) {
+				printf("Error creating training thread\n");
+				exit(1);
+			}
+		}
+	}
+
+	markov_input_batch = markov_get_batch();
+	trace_begin(&markov_input_span, "ingest");
+	if (wiki) {
+		struct dump_t dump;
+		dump_open(&dump, stdin, markov_num_threads);
+		wiki_read(&dump, markov_input_word);
+		dump_close(&dump);
+	} else
+		markov_read_words(stdin);
+	trace_end(&markov_input_span);
+	markov_submit_batch(markov_input_batch);
+
+	// Wait for the training threads to finish
+	if (markov_num_threads > 1) {
+		pthread_mutex_lock(&markov_queue_lock);
+		markov_queue_done = true;
+		pthread_cond_broadcast(&markov_queue_cond);
+		pthread_mutex_unlock(&markov_queue_lock);
+		for (i = 0; i < markov_num_threads; i++)
+			pthread_join(threads[i], NULL);
+	}
+	markov_finish_rehash();
+
+	// Report what was lost to stay within the memory budget. Training threads
+	// may have been behind at the last check.
+	markov_check_budget();
+	if (markov_prune_threshold)
+		markov_prune_report();
 
 	// Save the model
-	markov_export();
+	trace_begin(&span, "export");
+	if (markov_spill_dir)
+		markov_spill_export(model_file);
+	else
+		markov_export(model_file);
+	trace_end(&span);
 
+	trace_close();
 	return 0;
 }
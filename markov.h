@@ -1,7 +1,7 @@
 #ifndef MARKOV_H_
 #define MARKOV_H_
 
-// Structures for the markov export database
+// Structures for the markov model file
 
 #include <stdint.h>
 
@@ -12,6 +12,37 @@
 // offset of -1 means a NULL string.
 typedef int64_t string_offset_t;
 
+// Type of the length stored in front of each string in the string database.
+// A string is stored as its length, its characters and a null terminator, and
+// its offset points at the first character.
+typedef uint32_t string_length_t;
+
+// Magic number at the start of a model file ("MRKV")
+#define MARKOV_MAGIC 0x564b524d
+
+// Version of the model file format, increased on incompatible changes
+#define MARKOV_VERSION 3
+
+// Flag set in the model header when every exit list is followed by an alias
+// table
+#define MARKOV_FLAG_ALIAS 1
+
+// Flag set in the number of exits of a node, or in the number of start states,
+// when the exits have 64-bit counts. Only nodes whose total count doesn't fit
+// in 32 bits have them.
+#define MARKOV_EXITS_WIDE 0x80000000u
+
+// Alignment of the sections in a model file, so that every section starts on
+// its own page when the file is mapped
+#define MARKOV_SECTION_ALIGN 4096
+
+// Sections of a model file: the string database, the node database and the
+// start states database
+#define MARKOV_SECTION_STRINGS 0
+#define MARKOV_SECTION_NODES 1
+#define MARKOV_SECTION_START 2
+#define MARKOV_SECTIONS 3
+
 // Type of an offset in the database file. Using 64-bit int to allow files
 // larger than 4GB.
 typedef int64_t markov_offset_t;
@@ -20,27 +51,78 @@ typedef int64_t markov_offset_t;
 #pragma pack(push)
 #pragma pack(4)
 
+// A section of a model file. The offset is from the start of the file, and the
+// checksum is the XXH64 hash of the contents of the section.
+struct markov_section_t {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t checksum;
+};
+
+// Header at the start of a model file, followed by the sections. Offsets stored
+// inside a section are relative to the start of that section. The checksum
+// covers the header up to the checksum itself.
+struct markov_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t order;
+	uint32_t flags;
+	uint64_t num_strings;
+	uint64_t num_nodes;
+	uint64_t num_start_states;
+	uint32_t num_sections;
+	struct markov_section_t sections[MARKOV_SECTIONS];
+	uint64_t checksum;
+};
+
 // An exit of a node in the database. Count is cumulative, so you can perform
 // a binary search on the exit list when generating. The total count is the
 // count on the last exit.
 struct markov_export_exit_t {
 	markov_offset_t node;
-	int count;
+	uint32_t count;
+};
+
+// An exit with a 64-bit cumulative count, used instead of the above for the
+// exits of a node flagged with MARKOV_EXITS_WIDE
+struct markov_export_wide_exit_t {
+	markov_offset_t node;
+	uint64_t count;
+};
+
+// An entry of an alias table, which allows picking an exit in constant time
+// (Vose's alias method). Pick an entry uniformly, then keep it if a uniform
+// 32-bit value is below probability, or take the exit at index alias otherwise.
+struct markov_export_alias_t {
+	uint32_t probability;
+	uint32_t alias;
 };
 
-// A node in the database
+// A node in the database. If the database has alias tables, the exits are
+// followed by an alias table with one entry per exit. The number of exits may
+// have the MARKOV_EXITS_WIDE flag set, in which case the exits are wide exits.
 struct markov_export_node_t {
 	string_offset_t strings[MARKOV_ORDER];
-	int num_exits;
+	uint32_t num_exits;
 	struct markov_export_exit_t exits[0];
 };
 
-// Start database format
+// Start database format. If the markov database has alias tables, the start
+// states are followed by an alias table with one entry per start state. The
+// number of start states may have the MARKOV_EXITS_WIDE flag set like the
+// number of exits of a node.
 struct markov_export_start_t {
-	int num_start_states;
+	uint32_t num_start_states;
 	struct markov_export_exit_t start_states[0];
 };
 
 #pragma pack(pop)
 
+// Get the size of an exit in the database, given the number of exits of its
+// node along with its flags
+static inline int markov_exit_size(uint32_t num_exits)
+{
+	return num_exits & MARKOV_EXITS_WIDE ? sizeof(struct markov_export_wide_exit_t) : sizeof(struct markov_export_exit_t);
+}
+
 #endif
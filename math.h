@@ -2,6 +2,7 @@
 #define MATH_H_
 
 #include <stdbool.h>
+#include <time.h>
 
 // Get the maximum or minimum of two values
 #define max(x, y) ((x) > (y) ? (x) : (y))
@@ -28,4 +29,12 @@ static inline int align(int x, int align)
 	return (x + align - 1) & ~(align - 1);
 }
 
+// Get the current time in seconds, from a clock which only moves forward
+static inline double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 #endif
@@ -2,22 +2,25 @@
 #define MEMPOOL_H_
 
 #include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
 
-// Size of a block for mempool allocation
+// Size of a block for mempool allocation. Blocks are a huge page when backed
+// by huge pages.
 #define MEMPOOL_BLOCK_SIZE 262144
 
 // A memory pool
 struct mempool_t {
 	struct mempool_t *next;
-	int count;
+	int64_t count;
 };
 
 // Slow path: allocate a large memory block and split it
 static inline void *mempool_alloc_slow(struct mempool_t *pool, int size)
 {
-	int alloc_size = MEMPOOL_BLOCK_SIZE - (MEMPOOL_BLOCK_SIZE % size);
-	void *block = malloc(alloc_size);
-	assert(block);
+	int block_size = arena_huge_pages ? ARENA_HUGE_PAGE_SIZE : MEMPOOL_BLOCK_SIZE;
+	int alloc_size = block_size - (block_size % size);
+	void *block = arena_alloc(block_size);
 	void *pos;
 	for (pos = block; pos < block + alloc_size - size; pos += size) {
 		struct mempool_t *current = pos;
@@ -0,0 +1,58 @@
+#ifndef MMAPFILE_H_
+#define MMAPFILE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Memory map a file with the given protection and mapping flags. Returns NULL
+// for an empty file.
+static inline void *mmap_file_flags(const char *file, int64_t *length_ptr, int prot, int flags)
+{
+	// Open the file
+	int fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		printf("Error opening file %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	// Get the file length
+	struct stat buf;
+	fstat(fd, &buf);
+	int64_t length = buf.st_size;
+
+	// Make sure length fits in our address space
+	if (sizeof(void *) == 4 && length > 0xFFFFFFFF)
+		printf("Warning: File too big for 32bit address space\n");
+
+	if (length_ptr)
+		*length_ptr = length;
+
+	// Memory map the file
+	void *ptr = NULL;
+	if (length) {
+		ptr = mmap(NULL, length, prot, flags, fd, 0);
+		if (ptr == MAP_FAILED) {
+			printf("Error mmaping file %s: %s\n", file, strerror(errno));
+			exit(1);
+		}
+	}
+
+	close(fd);
+	return ptr;
+}
+
+// Memory map a file for reading
+static inline void *mmap_file(const char *file, int64_t *length_ptr)
+{
+	return mmap_file_flags(file, length_ptr, PROT_READ, MAP_SHARED);
+}
+
+#endif
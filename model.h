@@ -0,0 +1,156 @@
+#ifndef MODEL_H_
+#define MODEL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "hash.h"
+#include "markov.h"
+
+// A model file mapped into memory. If mapping fails, error describes why.
+struct model_t {
+	char *data;
+	int64_t length;
+	struct markov_header_t *header;
+	char error[256];
+};
+
+// Get the checksum of a model header
+static inline uint64_t model_header_checksum(const struct markov_header_t *header)
+{
+	return hash_checksum(header, offsetof(struct markov_header_t, checksum));
+}
+
+// Get a pointer to a section of a mapped model
+static inline void *model_section(const struct model_t *model, int section)
+{
+	return model->data + model->header->sections[section].offset;
+}
+
+// Get the size of a section of a mapped model
+static inline int64_t model_section_size(const struct model_t *model, int section)
+{
+	return model->header->sections[section].size;
+}
+
+// Check that a mapped model can be used by this program. The checksums of the
+// sections are only verified if requested, since that reads the whole file.
+static inline bool model_check(struct model_t *model, const char *file, bool verify)
+{
+	struct markov_header_t *header = model->header;
+	if (model->length < (int64_t)sizeof(struct markov_header_t) || header->magic != MARKOV_MAGIC) {
+		snprintf(model->error, sizeof(model->error), "%s is not a markov model", file);
+		return false;
+	}
+	if (header->version != MARKOV_VERSION) {
+		snprintf(model->error, sizeof(model->error), "Model %s has version %u, expected %u", file, header->version, MARKOV_VERSION);
+		return false;
+	}
+	if (header->checksum != model_header_checksum(header)) {
+		snprintf(model->error, sizeof(model->error), "Model %s has a corrupt header", file);
+		return false;
+	}
+	if (header->order != MARKOV_ORDER) {
+		snprintf(model->error, sizeof(model->error), "Model %s has order %u, expected %u", file, header->order, MARKOV_ORDER);
+		return false;
+	}
+	if (header->num_sections < MARKOV_SECTIONS) {
+		snprintf(model->error, sizeof(model->error), "Model %s has %u sections, expected %u", file, header->num_sections, MARKOV_SECTIONS);
+		return false;
+	}
+
+	int i;
+	for (i = 0; i < MARKOV_SECTIONS; i++) {
+		struct markov_section_t *section = &header->sections[i];
+		if (section->offset % MARKOV_SECTION_ALIGN || section->offset > (uint64_t)model->length || section->size > model->length - section->offset) {
+			snprintf(model->error, sizeof(model->error), "Model %s is truncated", file);
+			return false;
+		}
+		if (verify && section->checksum != hash_checksum(model->data + section->offset, section->size)) {
+			snprintf(model->error, sizeof(model->error), "Model %s has a corrupt section %d", file, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Memory map a model file with the given protection and mapping flags, and
+// check it. Returns false with an error message in the model on failure.
+static inline bool model_try_map(struct model_t *model, const char *file, int prot, int flags, bool verify)
+{
+	model->data = NULL;
+	model->length = 0;
+
+	int fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		snprintf(model->error, sizeof(model->error), "Error opening model %s: %s", file, strerror(errno));
+		return false;
+	}
+	struct stat buf;
+	fstat(fd, &buf);
+	model->length = buf.st_size;
+	if (model->length) {
+		model->data = mmap(NULL, model->length, prot, flags, fd, 0);
+		if (model->data == MAP_FAILED) {
+			snprintf(model->error, sizeof(model->error), "Error mmaping model %s: %s", file, strerror(errno));
+			model->data = NULL;
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+	model->header = (struct markov_header_t *)model->data;
+
+	if (!model_check(model, file, verify)) {
+		if (model->data)
+			munmap(model->data, model->length);
+		model->data = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Memory map a model file like model_try_map(), and exit if it can't be used
+static inline void model_map(struct model_t *model, const char *file, int prot, int flags, bool verify)
+{
+	if (!model_try_map(model, file, prot, flags, verify)) {
+		printf("%s\n", model->error);
+		exit(1);
+	}
+}
+
+// Touch every page of a mapped model, so that it is all in memory before it is
+// used
+static inline void model_prefault(const struct model_t *model)
+{
+	volatile char sum = 0;
+	int64_t offset;
+	for (offset = 0; offset < model->length; offset += MARKOV_SECTION_ALIGN)
+		sum += model->data[offset];
+	(void)sum;
+}
+
+// Give the kernel advice about how a mapped model will be used. The advice is
+// only a hint, so failing to follow it is not an error.
+static inline void model_advise(const struct model_t *model, int advice)
+{
+	if (model->data)
+		madvise(model->data, model->length, advice);
+}
+
+// Unmap a model file
+static inline void model_unmap(struct model_t *model)
+{
+	munmap(model->data, model->length);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <stdint.h>
+
+// State of a xoshiro256** pseudo-random number generator, from
+// http://prng.di.unimi.it/
+struct rng_t {
+	uint64_t s[4];
+};
+
+// Rotate a 64-bit value left
+static inline uint64_t rng_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+// Step of the splitmix64 generator, used to expand a seed into a full state
+static inline uint64_t rng_splitmix(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// Seed a generator
+static inline void rng_seed(struct rng_t *rng, uint64_t seed)
+{
+	int i;
+	for (i = 0; i < 4; i++)
+		rng->s[i] = rng_splitmix(&seed);
+}
+
+// Seed a generator for one of several independent streams sharing a seed. The
+// stream index is scrambled first, since nearby seeds give overlapping
+// splitmix64 sequences.
+static inline void rng_seed_stream(struct rng_t *rng, uint64_t seed, uint64_t stream)
+{
+	rng_seed(rng, seed ^ rng_splitmix(&stream));
+}
+
+// Get the next 64-bit random number
+static inline uint64_t rng_next(struct rng_t *rng)
+{
+	uint64_t *s = rng->s;
+	uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rng_rotl(s[3], 45);
+
+	return result;
+}
+
+#endif
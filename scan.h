@@ -0,0 +1,53 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Search of delimiters in large buffers of text. Bytes are compared 32 at a
+// time with AVX2 and 16 at a time with SSE2, and one at a time on other
+// machines and for the last few bytes of a buffer.
+
+// Find the first byte of a buffer which is either of two characters. Returns
+// the end of the buffer if there is none.
+static inline const char *scan_find2(const char *p, const char *end, char a, char b)
+{
+#if defined(__AVX2__)
+	__m256i a32 = _mm256_set1_epi8(a);
+	__m256i b32 = _mm256_set1_epi8(b);
+	while (end - p >= 32) {
+		__m256i data = _mm256_loadu_si256((const __m256i *)p);
+		uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(data, a32), _mm256_cmpeq_epi8(data, b32)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i a16 = _mm_set1_epi8(a);
+	__m128i b16 = _mm_set1_epi8(b);
+	while (end - p >= 16) {
+		__m128i data = _mm_loadu_si128((const __m128i *)p);
+		uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(data, a16), _mm_cmpeq_epi8(data, b16)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != a && *p != b)
+		p++;
+	return p;
+}
+
+// Find the first occurrence of a character in a buffer. Returns the end of
+// the buffer if there is none.
+static inline const char *scan_find(const char *p, const char *end, char c)
+{
+	return scan_find2(p, end, c, c);
+}
+
+#endif
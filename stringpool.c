@@ -1,13 +1,20 @@
 #include <stdlib.h>
 #include "stringpool.h"
 
-// String pool table
-struct string_pool_t *string_pool[STRING_TABLE_SIZE];
+// String pool hash table
+struct table_t string_table;
 
-// Current memory block used for string allocation
-void *string_mem;
-int string_mem_offset;
+// Table mapping ids to strings
+const char **string_ids[STRING_ID_CHUNKS];
+
+// Offset of each string in the string file, indexed by id
+string_offset_t *string_offsets;
+
+// Current memory block used for string allocation. The offset starts at the end
+// of an empty block so that each thread allocates its first block on demand.
+__thread void *string_mem;
+__thread int string_mem_offset = STRING_BLOCK_SIZE;
 
 // Amount of memory used by string pool
-int string_mem_usage;
-int string_pool_count;
+int64_t string_mem_usage;
+string_id_t string_pool_count;
@@ -4,67 +4,130 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "hash.h"
 #include "markov.h"
+#include "table.h"
 #include "math.h"
 
-// Size of the string pool hash table
-#define STRING_TABLE_SIZE 0x400000
-
 // Size of a block of memory for use in the string pool
 #define STRING_BLOCK_SIZE 0x400000
 
+// Number of ids in each chunk of the id table, and the maximum number of chunks
+#define STRING_ID_CHUNK_SIZE 0x10000
+#define STRING_ID_CHUNKS 0x10000
+
+// Dense id of a string in the pool. Ids are handed out in the order strings are
+// first interned, starting from 1. Id 0 stands for a NULL string.
+typedef uint32_t string_id_t;
+
 // String pool hash table entry
 struct string_pool_t {
-	struct string_pool_t *next;
-	union {
-		char string[0];
-		string_offset_t offset;
-	};
+	struct table_entry_t entry;
+	string_id_t id;
+	char string[0];
 };
 
-// String pool table
-extern struct string_pool_t *string_pool[STRING_TABLE_SIZE];
+// String pool hash table
+extern struct table_t string_table;
+
+// Table mapping ids to strings. It is split into chunks which are allocated on
+// demand, so that it can grow without moving existing entries.
+extern const char **string_ids[STRING_ID_CHUNKS];
 
-// Current memory block used for string allocation
-extern void *string_mem;
-extern int string_mem_offset;
+// Offset of each string in the string file, indexed by id. Only valid after
+// string_layout().
+extern string_offset_t *string_offsets;
+
+// Current memory block used for string allocation. Each thread allocates from
+// its own block.
+extern __thread void *string_mem;
+extern __thread int string_mem_offset;
 
 // Amount of memory used by string pool
-extern int string_mem_usage;
-extern int string_pool_count;
+extern int64_t string_mem_usage;
+extern string_id_t string_pool_count;
 
-// Allocate a copy of a string, or return an existing copy
-static inline const char *string_copy(const char *string)
+// Record the string for an id in the id table
+static inline void string_set_id(string_id_t id, const char *string)
+{
+	const char **chunk = string_ids[id / STRING_ID_CHUNK_SIZE];
+	if (!chunk) {
+		// Several threads may race to allocate the same chunk, only one wins
+		chunk = calloc(STRING_ID_CHUNK_SIZE, sizeof(const char *));
+		assert(chunk);
+		if (!__sync_bool_compare_and_swap(&string_ids[id / STRING_ID_CHUNK_SIZE], NULL, chunk)) {
+			free(chunk);
+			chunk = string_ids[id / STRING_ID_CHUNK_SIZE];
+		}
+	}
+	chunk[id % STRING_ID_CHUNK_SIZE] = string;
+}
+
+// Get the string for an id
+static inline const char *string_get(string_id_t id)
+{
+	if (!id)
+		return NULL;
+	return string_ids[id / STRING_ID_CHUNK_SIZE][id % STRING_ID_CHUNK_SIZE];
+}
+
+// Hash a string of the pool. The djb2 hash is used as it is: similar words get
+// nearby buckets, which keeps the buckets of the most frequent words in fewer
+// cache lines.
+static inline unsigned int string_hash(const char *string)
+{
+	return hash_string(string);
+}
+
+// Hash an entry of the string pool table
+static inline unsigned int string_hash_entry(const struct table_entry_t *entry)
+{
+	return string_hash(((const struct string_pool_t *)entry)->string);
+}
+
+// Allocate a copy of a string, or return an existing copy. Returns the id of
+// the string.
+static inline string_id_t string_copy(const char *string)
 {
 	// Hash the string
-	int hash = hash_string(string) & (STRING_TABLE_SIZE - 1);
+	unsigned int hash = string_hash(string);
+	struct table_shard_t *shard = table_shard(&string_table, hash);
 
 	// Search the table for the string
 	struct string_pool_t *current;
-	for (current = string_pool[hash]; current; current = current->next) {
-		if (!strcmp(current->string, string))
-			return current->string;
+	pthread_mutex_lock(&shard->lock);
+	struct table_entry_t **bucket = table_bucket(&string_table, shard, hash);
+	for (current = (struct string_pool_t *)*bucket; current; current = (struct string_pool_t *)current->entry.next) {
+		if (!strcmp(current->string, string)) {
+			pthread_mutex_unlock(&shard->lock);
+			return current->id;
+		}
 	}
 
 	// String was not found, so allocate a copy and add it to the hash table
-	unsigned int length = sizeof(struct string_pool_t *) + strlen(string) + 1;
-
-	// Make sure we have enough space for the offset
-	length = max(length, sizeof(struct string_pool_t));
+	unsigned int length = sizeof(struct string_pool_t) + strlen(string) + 1;
 
 	// Make sure length is properly aligned to machine word length
 	length = align(length, sizeof(void *));
 
 	// Track memory usage
-	string_mem_usage += length;
-	string_pool_count++;
-
-	// Try to allocate from current memory block, get a new block if full
-	if (string_mem_offset + length > STRING_BLOCK_SIZE) {
-		string_mem = malloc(STRING_BLOCK_SIZE);
+	__sync_fetch_and_add(&string_mem_usage, length);
+	string_id_t id = __sync_add_and_fetch(&string_pool_count, 1);
+
+	// The id space covers every 32-bit value, so running out wraps around to 0
+	assert(id != 0);
+
+	// Try to allocate from current memory block, get a new block if full. A
+	// string which doesn't fit in a block gets memory of its own.
+	if (length > STRING_BLOCK_SIZE)
+		current = arena_alloc(length);
+	else if (string_mem_offset + length > STRING_BLOCK_SIZE) {
+		string_mem = arena_alloc(STRING_BLOCK_SIZE);
 		string_mem_offset = length;
 		current = string_mem;
 	} else {
@@ -73,43 +136,57 @@ static inline const char *string_copy(const char *string)
 	}
 
 	// Add string to hash table and return it
-	current->next = string_pool[hash];
+	current->id = id;
 	strcpy(current->string, string);
-	string_pool[hash] = current;
-	return current->string;
+	string_set_id(id, current->string);
+	table_insert(&string_table, shard, bucket, &current->entry);
+	pthread_mutex_unlock(&shard->lock);
+	return id;
 }
 
 // Initialize string pool
 static inline void string_init(void)
 {
-	string_mem = malloc(STRING_BLOCK_SIZE);
+	table_init(&string_table, string_hash_entry);
 }
 
 // Get the offset of a string in the string file
-static inline string_offset_t string_offset(const char *string)
+static inline string_offset_t string_offset(string_id_t id)
 {
-	if (!string)
+	if (!id)
 		return -1;
-	struct string_pool_t *current = (void *)string - offsetof(struct string_pool_t, string);
-	return current->offset;
+	return string_offsets[id];
 }
 
-// Write the string pool to a file. Note that string won't be readable anymore
-// after this operation.
-static inline void string_export(FILE *file)
+// Compute the offset of each string in the string file, so that other files
+// can refer to strings before the string file is written. Returns the size of
+// the string file.
+static inline string_offset_t string_layout(void)
 {
+	string_offsets = malloc(sizeof(string_offset_t) * ((size_t)string_pool_count + 1));
+	assert(string_offsets);
+
 	string_offset_t offset = 0;
-	int i;
-	for (i = 0; i < STRING_TABLE_SIZE; i++) {
-		struct string_pool_t *current;
-		for (current = string_pool[i]; current; current = current->next) {
-			int length = strlen(current->string) + 1;
-			if (!fwrite(current->string, length, 1, file)) {
-				printf("Error writing to string database: %s\n", strerror(errno));
-				exit(1);
-			}
-			current->offset = offset;
-			offset += length;
+	string_id_t id;
+	for (id = 1; id <= (string_id_t)string_pool_count; id++) {
+		string_offsets[id] = offset + sizeof(string_length_t);
+		offset += sizeof(string_length_t) + strlen(string_get(id)) + 1;
+	}
+	return offset;
+}
+
+// Write the string pool to a file, in id order. Each string is preceded by its
+// length so that readers don't need strlen(). string_layout() must be called
+// first.
+static inline void string_export(FILE *file)
+{
+	string_id_t id;
+	for (id = 1; id <= (string_id_t)string_pool_count; id++) {
+		const char *string = string_get(id);
+		string_length_t length = strlen(string);
+		if (!fwrite(&length, sizeof(length), 1, file) || !fwrite(string, length + 1, 1, file)) {
+			printf("Error writing to string database: %s\n", strerror(errno));
+			exit(1);
 		}
 	}
 }
@@ -0,0 +1,221 @@
+#ifndef TABLE_H_
+#define TABLE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "arena.h"
+#include "hash.h"
+
+// Chained hash tables which start small and grow with their contents. A table
+// is split into shards, selected by the top bits of the hash, and each shard
+// has its own lock and bucket array. A shard which gets too full switches to a
+// bucket array twice as big, and its entries are moved over a few buckets at a
+// time by the lookups that follow, so that growing never holds up the shard
+// for long. Until its bucket has been moved, an entry stays in the old array.
+
+// Number of shards in a table, and the initial number of buckets of a shard
+#define TABLE_SHARD_BITS 8
+#define TABLE_SHARDS (1 << TABLE_SHARD_BITS)
+#define TABLE_INITIAL_SIZE 0x40
+
+// Number of buckets of the old array moved on each lookup while a shard grows.
+// The shard doubles again once its number of entries has doubled, so moving at
+// least two buckets per insertion is enough to be done by then.
+#define TABLE_REHASH_STEP 16
+
+// An entry of a table, which must be the first member of the entry structure
+struct table_entry_t {
+	struct table_entry_t *next;
+};
+
+// Function computing the hash of an entry, used to move it to its new bucket
+typedef unsigned int (*table_hash_t)(const struct table_entry_t *entry);
+
+// A shard of a table. While the shard grows, old_buckets holds the previous
+// bucket array, of which the buckets before rehash_index have been moved.
+struct table_shard_t {
+	pthread_mutex_t lock;
+	struct table_entry_t **buckets;
+	unsigned int mask;
+	int64_t count;
+	struct table_entry_t **old_buckets;
+	unsigned int old_mask;
+	unsigned int rehash_index;
+};
+
+// A hash table
+struct table_t {
+	struct table_shard_t shards[TABLE_SHARDS];
+	table_hash_t hash;
+};
+
+// Initialize an empty table
+static inline void table_init(struct table_t *table, table_hash_t hash)
+{
+	table->hash = hash;
+	int i;
+	for (i = 0; i < TABLE_SHARDS; i++) {
+		struct table_shard_t *shard = &table->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->buckets = arena_calloc(TABLE_INITIAL_SIZE * sizeof(struct table_entry_t *));
+		shard->mask = TABLE_INITIAL_SIZE - 1;
+		shard->count = 0;
+		shard->old_buckets = NULL;
+	}
+}
+
+// Get the shard of a table which holds a given hash. Hashes of short strings
+// barely reach the top bits, so the hash is mixed first to spread entries and
+// lock traffic over all the shards. Buckets still use the hash as it is.
+static inline struct table_shard_t *table_shard(struct table_t *table, unsigned int hash)
+{
+	return &table->shards[hash_mix(hash) >> (32 - TABLE_SHARD_BITS)];
+}
+
+// Move up to a number of buckets of a growing shard to its new bucket array.
+// The caller must hold the lock of the shard.
+static inline void table_rehash(struct table_t *table, struct table_shard_t *shard, unsigned int steps)
+{
+	while (steps-- && shard->rehash_index <= shard->old_mask) {
+		struct table_entry_t *current = shard->old_buckets[shard->rehash_index++];
+		while (current) {
+			struct table_entry_t *next = current->next;
+			struct table_entry_t **bucket = &shard->buckets[table->hash(current) & shard->mask];
+			current->next = *bucket;
+			*bucket = current;
+			current = next;
+		}
+	}
+
+	if (shard->rehash_index > shard->old_mask) {
+		arena_free(shard->old_buckets, (size_t)(shard->old_mask + 1) * sizeof(struct table_entry_t *));
+		shard->old_buckets = NULL;
+	}
+}
+
+// Get the bucket which holds the entries with a given hash, moving along the
+// growth of the shard first. The caller must hold the lock of the shard.
+static inline struct table_entry_t **table_bucket(struct table_t *table, struct table_shard_t *shard, unsigned int hash)
+{
+	if (shard->old_buckets) {
+		table_rehash(table, shard, TABLE_REHASH_STEP);
+		if (shard->old_buckets && (hash & shard->old_mask) >= shard->rehash_index)
+			return &shard->old_buckets[hash & shard->old_mask];
+	}
+	return &shard->buckets[hash & shard->mask];
+}
+
+// Add an entry to a bucket obtained from table_bucket(), and start growing the
+// shard if it has as many entries as buckets. The caller must hold the lock of
+// the shard.
+static inline void table_insert(struct table_t *table, struct table_shard_t *shard, struct table_entry_t **bucket,
+                                struct table_entry_t *entry)
+{
+	entry->next = *bucket;
+	*bucket = entry;
+	if (++shard->count <= shard->mask + 1)
+		return;
+
+	// Finish any previous growth, which only happens if lookups were too few
+	// to move all the buckets
+	if (shard->old_buckets)
+		table_rehash(table, shard, shard->old_mask + 1);
+
+	shard->old_buckets = shard->buckets;
+	shard->old_mask = shard->mask;
+	shard->rehash_index = 0;
+	shard->buckets = arena_calloc((size_t)(shard->mask + 1) * 2 * sizeof(struct table_entry_t *));
+	shard->mask = shard->mask * 2 + 1;
+}
+
+// Finish growing every shard of a table, so that all entries are in the
+// current bucket arrays. Must only be called while no other thread uses the
+// table.
+static inline void table_finish(struct table_t *table)
+{
+	int i;
+	for (i = 0; i < TABLE_SHARDS; i++) {
+		struct table_shard_t *shard = &table->shards[i];
+		if (shard->old_buckets)
+			table_rehash(table, shard, shard->old_mask + 1);
+	}
+}
+
+// Position of an iteration over all the entries of a table. The link points to
+// the next entry, and current to the link of the last entry returned.
+struct table_iter_t {
+	struct table_t *table;
+	int shard;
+	unsigned int bucket;
+	struct table_entry_t **link;
+	struct table_entry_t **current;
+};
+
+// Start iterating over a table. The table must not be growing, see
+// table_finish(), and no other thread may use it during the iteration.
+static inline void table_iter_init(struct table_iter_t *iter, struct table_t *table)
+{
+	int i;
+	for (i = 0; i < TABLE_SHARDS; i++)
+		assert(!table->shards[i].old_buckets);
+
+	iter->table = table;
+	iter->shard = 0;
+	iter->bucket = 0;
+	iter->link = &table->shards[0].buckets[0];
+	iter->current = NULL;
+}
+
+// Get the next entry of a table, or NULL at the end
+static inline struct table_entry_t *table_iter_next(struct table_iter_t *iter)
+{
+	while (!*iter->link) {
+		if (++iter->bucket > iter->table->shards[iter->shard].mask) {
+			if (++iter->shard == TABLE_SHARDS)
+				return NULL;
+			iter->bucket = 0;
+		}
+		iter->link = &iter->table->shards[iter->shard].buckets[iter->bucket];
+	}
+
+	struct table_entry_t *entry = *iter->link;
+	iter->current = iter->link;
+	iter->link = &entry->next;
+	return entry;
+}
+
+// Remove the last entry returned by table_iter_next() from the table
+static inline void table_iter_remove(struct table_iter_t *iter)
+{
+	*iter->current = (*iter->current)->next;
+	iter->link = iter->current;
+	iter->table->shards[iter->shard].count--;
+}
+
+// Get the number of entries in a table
+static inline int64_t table_count(struct table_t *table)
+{
+	int64_t count = 0;
+	int i;
+	for (i = 0; i < TABLE_SHARDS; i++)
+		count += table->shards[i].count;
+	return count;
+}
+
+// Get the memory used by the bucket arrays of a table
+static inline int64_t table_memory(struct table_t *table)
+{
+	int64_t size = 0;
+	int i;
+	for (i = 0; i < TABLE_SHARDS; i++) {
+		struct table_shard_t *shard = &table->shards[i];
+		size += (int64_t)(shard->mask + 1) * sizeof(struct table_entry_t *);
+		if (shard->old_buckets)
+			size += (int64_t)(shard->old_mask + 1) * sizeof(struct table_entry_t *);
+	}
+	return size;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "math.h"
+
+// Phase tracing in the Chrome trace event format, which can be loaded into
+// chrome://tracing or Perfetto. Each phase is written as a complete event with
+// its wall time, and has as arguments the CPU time and page faults of the
+// thread during the phase and the peak RSS of the process at its end. A phase
+// must end on the thread it began on. When tracing is disabled, phases cost a
+// single branch.
+
+// A phase being timed
+struct trace_span_t {
+	const char *name;
+	double start;
+	struct rusage usage;
+};
+
+// Trace file, or NULL if tracing is disabled. Events are written as soon as
+// they end, so the file is usable even if the program is killed.
+static FILE *trace_file;
+static double trace_start;
+static bool trace_first_event;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Get the current time in microseconds
+static inline double trace_time(void)
+{
+	return get_time() * 1e6;
+}
+
+// Get the time in a timeval in milliseconds
+static inline double trace_timeval_ms(struct timeval tv)
+{
+	return tv.tv_sec * 1e3 + tv.tv_usec * 1e-3;
+}
+
+// Start writing a trace to a file
+static inline void trace_open(const char *file)
+{
+	trace_file = fopen(file, "w");
+	if (!trace_file) {
+		printf("Error opening trace %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	fputs("[\n", trace_file);
+	trace_start = trace_time();
+	trace_first_event = true;
+}
+
+// Finish the trace
+static inline void trace_close(void)
+{
+	if (!trace_file)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	fputs("\n]\n", trace_file);
+	if (fclose(trace_file))
+		printf("Error writing trace: %s\n", strerror(errno));
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// Write an event to the trace. The fields are formatted by the caller, and
+// the trace lock must be held.
+static inline void trace_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static inline void trace_write(const char *format, ...)
+{
+	if (!trace_first_event)
+		fputs(",\n", trace_file);
+	trace_first_event = false;
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(trace_file, format, args);
+	va_end(args);
+	fflush(trace_file);
+}
+
+// Name the current thread in the trace
+static inline void trace_thread_name(const char *format, int index)
+{
+	if (!trace_file)
+		return;
+
+	char name[64];
+	snprintf(name, sizeof(name), format, index);
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		trace_write("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %ld, \"args\": {\"name\": \"%s\"}}",
+		            getpid(), syscall(SYS_gettid), name);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// Start timing a phase
+static inline void trace_begin(struct trace_span_t *span, const char *name)
+{
+	if (!trace_file)
+		return;
+
+	span->name = name;
+	getrusage(RUSAGE_THREAD, &span->usage);
+	span->start = trace_time();
+}
+
+// Finish timing a phase and write it to the trace
+static inline void trace_end(struct trace_span_t *span)
+{
+	if (!trace_file)
+		return;
+
+	double end = trace_time();
+	struct rusage usage;
+	struct rusage process;
+	getrusage(RUSAGE_THREAD, &usage);
+	getrusage(RUSAGE_SELF, &process);
+	double user = trace_timeval_ms(usage.ru_utime) - trace_timeval_ms(span->usage.ru_utime);
+	double sys = trace_timeval_ms(usage.ru_stime) - trace_timeval_ms(span->usage.ru_stime);
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		trace_write("{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f, "
+		            "\"args\": {\"cpu_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, "
+		            "\"minor_faults\": %ld, \"major_faults\": %ld, \"peak_rss_kb\": %ld}}",
+		            span->name, getpid(), syscall(SYS_gettid), span->start - trace_start, end - span->start,
+		            user + sys, user, sys, usage.ru_minflt - span->usage.ru_minflt,
+		            usage.ru_majflt - span->usage.ru_majflt, process.ru_maxrss);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+#endif
@@ -0,0 +1,388 @@
+#ifndef WIKI_H_
+#define WIKI_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <expat.h>
+#include "dump.h"
+#include "math.h"
+
+// Reads a MediaWiki XML dump and turns the text of its articles into words and
+// sentences, doing the work of extract, strip and convert in a single pass
+// with no intermediate text. Each article is collected whole and then scanned
+// with the rules of strip.l, and a dot inside a number ends the sentence like
+// convert does. Each article is scanned on its own, starting at the beginning
+// of a line and ending its last sentence.
+
+// Number of bytes read from the dump at once
+#define WIKI_READ_SIZE 0x100000
+
+// Maximum number of words kept inside a link, like in strip.l
+#define WIKI_TOKENS_SIZE 2000
+
+// Function receiving the words, an empty word ends a sentence
+typedef void (*wiki_word_t)(const char *word, int length);
+
+// State of the dump reader
+struct wiki_t {
+	wiki_word_t output;
+
+	// XML element depth, and the depth of the text element being read
+	int depth;
+	bool in_text;
+	int text_depth;
+
+	// Text of the current article
+	char *text;
+	int length;
+	int size;
+
+	// Word being output, and whether the current sentence has any words
+	char *word;
+	int word_length;
+	int word_size;
+	bool in_sentence;
+
+	// Markup state: link nesting depth, whether we are inside a table, and
+	// the words of the current link as offsets into the text
+	int link_depth;
+	bool in_table;
+	int tokens[WIKI_TOKENS_SIZE];
+	int token_lengths[WIKI_TOKENS_SIZE];
+	int num_tokens;
+};
+
+// Append bytes to a growable buffer
+static inline void wiki_append(char **buffer, int *length, int *size, const char *data, int data_length)
+{
+	if (*length + data_length > *size) {
+		while (*length + data_length > *size)
+			*size = *size ? *size * 2 : 0x10000;
+		*buffer = realloc(*buffer, *size);
+		if (!*buffer) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(*buffer + *length, data, data_length);
+	*length += data_length;
+}
+
+// End the current line of output. A non-empty line is a word, an empty one
+// ends the sentence.
+static inline void wiki_newline(struct wiki_t *wiki)
+{
+	if (wiki->word_length) {
+		wiki_append(&wiki->word, &wiki->word_length, &wiki->word_size, "", 1);
+		wiki->output(wiki->word, wiki->word_length - 1);
+		wiki->word_length = 0;
+		wiki->in_sentence = true;
+	} else if (wiki->in_sentence) {
+		wiki->output("", 0);
+		wiki->in_sentence = false;
+	}
+}
+
+// Output text as part of the current word. Dots end the sentence.
+static inline void wiki_print(struct wiki_t *wiki, const char *text, int length)
+{
+	const char *dot;
+	while ((dot = memchr(text, '.', length))) {
+		wiki_append(&wiki->word, &wiki->word_length, &wiki->word_size, text, dot - text);
+		wiki_newline(wiki);
+		wiki_newline(wiki);
+		length -= dot + 1 - text;
+		text = dot + 1;
+	}
+	wiki_append(&wiki->word, &wiki->word_length, &wiki->word_size, text, length);
+}
+
+// Check whether a character can be part of a word
+static inline bool wiki_is_word(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c && strchr(",'-;()\\/:", c));
+}
+
+// Check whether a character is a digit
+static inline bool wiki_is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// Check whether a character is white space
+static inline bool wiki_is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Get the length of the text starting at a position which begins with the
+// given string, or 0 if it doesn't
+static inline int wiki_prefix(const char *text, const char *end, const char *prefix)
+{
+	int length = strlen(prefix);
+	return end - text >= length && !memcmp(text, prefix, length) ? length : 0;
+}
+
+// Get the length of a template at a position, or 0 if there isn't one
+static inline int wiki_template(const char *text, const char *end)
+{
+	const char *close = memchr(text + 2, '}', end - text - 2);
+	if (!close || close + 1 == end || close[1] != '}')
+		return 0;
+	return close + 2 - text;
+}
+
+// Get the length of a reference at a position, or 0 if there isn't one.
+// References either have a body ending with </ref>, or are closed with />.
+static inline int wiki_reference(const char *text, const char *end)
+{
+	const char *p = text + 4;
+	while (p < end && *p != '>' && *p != '/')
+		p++;
+	if (p < end && *p == '>') {
+		const char *close = memchr(p, '<', end - p);
+		if (close && wiki_prefix(close, end, "</ref>"))
+			return close + 6 - text;
+		return 0;
+	}
+
+	const char *close = memchr(text + 4, '>', end - text - 4);
+	if (close && close - 1 >= text + 4 && close[-1] == '/')
+		return close + 1 - text;
+	return 0;
+}
+
+// Get the length of a line at a position, or 0 if it isn't followed by a
+// newline
+static inline int wiki_line(const char *text, const char *end)
+{
+	const char *newline = memchr(text, '\n', end - text);
+	return newline ? newline - text : 0;
+}
+
+// Get the length of a word at a position, which is either a run of word
+// characters or a decimal number, whichever is longer
+static inline int wiki_word(const char *text, const char *end)
+{
+	const char *p = text;
+	while (p < end && wiki_is_word(*p))
+		p++;
+	int length = p - text;
+
+	p = text;
+	while (p < end && wiki_is_digit(*p))
+		p++;
+	if (p + 1 < end && *p == '.' && wiki_is_digit(p[1])) {
+		p++;
+		while (p < end && wiki_is_digit(*p))
+			p++;
+		if (p - text > length)
+			length = p - text;
+	}
+	return length;
+}
+
+// Handle a word of the article text
+static inline void wiki_token(struct wiki_t *wiki, int offset, int length)
+{
+	if (!wiki->link_depth) {
+		if (!wiki->in_table)
+			wiki_print(wiki, wiki->text + offset, length);
+	} else if (wiki->num_tokens < WIKI_TOKENS_SIZE) {
+		wiki->tokens[wiki->num_tokens] = offset;
+		wiki->token_lengths[wiki->num_tokens++] = length;
+	}
+}
+
+// Scan the text of an article and output its words. Markup is matched like
+// flex does for strip.l: the longest match wins, then the first rule.
+static inline void wiki_scan(struct wiki_t *wiki)
+{
+	const char *text = wiki->text;
+	const char *end = text + wiki->length;
+	const char *p = text;
+	while (p < end) {
+		bool line_start = p == text || p[-1] == '\n';
+		int length = 1;
+		switch (*p) {
+		case '{':
+			// Templates are skipped, and tables are not output
+			if (p + 1 < end && p[1] == '{')
+				length = max(wiki_template(p, end), 1);
+			else if (p + 1 < end && p[1] == '|') {
+				wiki->in_table = true;
+				length = 2;
+			}
+			break;
+
+		case '|':
+			// A pipe in a link replaces the words before it
+			if (p + 1 < end && p[1] == '}') {
+				wiki->in_table = false;
+				length = 2;
+			} else
+				wiki->num_tokens = 0;
+			break;
+
+		case '<':
+			if (wiki_prefix(p, end, "<ref"))
+				length = max(wiki_reference(p, end), 1);
+			break;
+
+		case '#':
+			// Redirects are skipped
+			if (line_start && wiki_prefix(p, end, "#REDIRECT"))
+				length = max(wiki_line(p, end), 1);
+			break;
+
+		case '=':
+			// Headings are skipped
+			if (line_start && p + 1 < end && p[1] == '=')
+				length = max(wiki_line(p, end), 1);
+			break;
+
+		case '[':
+			if (p + 1 < end && p[1] == '[') {
+				wiki->link_depth++;
+				length = 2;
+			}
+			break;
+
+		case ']':
+			// The words of a link are output once it is closed
+			if (p + 1 < end && p[1] == ']') {
+				length = 2;
+				if (--wiki->link_depth == 0 && wiki->num_tokens) {
+					int i;
+					for (i = 0; i < wiki->num_tokens; i++) {
+						if (i)
+							wiki_newline(wiki);
+						wiki_print(wiki, text + wiki->tokens[i], wiki->token_lengths[i]);
+					}
+					wiki->num_tokens = 0;
+				}
+			}
+			break;
+
+		case '.':
+			if (p + 1 < end && wiki_is_digit(p[1]))
+				length = wiki_word(p, end);
+			if (length > 1)
+				wiki_token(wiki, p - text, length);
+			else if (!wiki->link_depth && !wiki->in_table)
+				wiki_newline(wiki);
+			break;
+
+		case '*':
+			// List items start a new line and close any open link
+			if (line_start) {
+				while (p + length < end && p[length] == '*')
+					length++;
+				wiki_newline(wiki);
+				wiki->link_depth = 0;
+			}
+			break;
+
+		default:
+			if (wiki_is_space(*p)) {
+				while (p + length < end && wiki_is_space(p[length]))
+					length++;
+				if (!wiki->link_depth && !wiki->in_table)
+					wiki_newline(wiki);
+			} else if (wiki_is_word(*p)) {
+				length = wiki_word(p, end);
+
+				// Lines starting with exactly two dashes are not words
+				if (!(line_start && length == 2 && p[0] == '-' && p[1] == '-'))
+					wiki_token(wiki, p - text, length);
+			}
+			break;
+		}
+		p += length;
+	}
+
+	// End the last sentence of the article, and reset the markup state
+	wiki_newline(wiki);
+	wiki_newline(wiki);
+	wiki->link_depth = 0;
+	wiki->in_table = false;
+	wiki->num_tokens = 0;
+}
+
+// Expat handler for the start of an element
+static void wiki_start_element(void *data, const char *name, const char **attributes)
+{
+	struct wiki_t *wiki = data;
+	(void)attributes;
+
+	if (!wiki->in_text && !strcmp(name, "text")) {
+		wiki->in_text = true;
+		wiki->text_depth = wiki->depth;
+		wiki->length = 0;
+	}
+	wiki->depth++;
+}
+
+// Expat handler for the end of an element
+static void wiki_end_element(void *data, const char *name)
+{
+	struct wiki_t *wiki = data;
+	(void)name;
+
+	wiki->depth--;
+	if (wiki->in_text && wiki->depth == wiki->text_depth) {
+		wiki->in_text = false;
+		wiki_scan(wiki);
+	}
+}
+
+// Expat handler for character data
+static void wiki_characters(void *data, const char *text, int length)
+{
+	struct wiki_t *wiki = data;
+	if (wiki->in_text)
+		wiki_append(&wiki->text, &wiki->length, &wiki->size, text, length);
+}
+
+// Read a dump and pass the words of its articles to a function
+static inline void wiki_read(struct dump_t *dump, wiki_word_t output)
+{
+	struct wiki_t wiki;
+	memset(&wiki, 0, sizeof(wiki));
+	wiki.output = output;
+
+	XML_Parser parser = XML_ParserCreate(NULL);
+	if (!parser) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	XML_SetUserData(parser, &wiki);
+	XML_SetElementHandler(parser, wiki_start_element, wiki_end_element);
+	XML_SetCharacterDataHandler(parser, wiki_characters);
+
+	// Read straight into the parser's buffer
+	bool done;
+	do {
+		void *buffer = XML_GetBuffer(parser, WIKI_READ_SIZE);
+		if (!buffer) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+		size_t length = dump_read(dump, buffer, WIKI_READ_SIZE);
+		done = length == 0;
+		if (XML_ParseBuffer(parser, length, done) == XML_STATUS_ERROR) {
+			printf("%s at line %lu\n", XML_ErrorString(XML_GetErrorCode(parser)),
+			       (unsigned long)XML_GetCurrentLineNumber(parser));
+			exit(1);
+		}
+	} while (!done);
+
+	XML_ParserFree(parser);
+	free(wiki.text);
+	free(wiki.word);
+}
+
+#endif